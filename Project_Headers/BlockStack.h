@@ -5,6 +5,9 @@
  * \date 04.01.2014
  */
 
+#ifndef BLOCKSTACK_H_
+#define BLOCKSTACK_H_
+
 #include "PE_Types.h"
 
 typedef struct BLOCK_Object {
@@ -27,9 +30,12 @@ typedef struct BLOCK_FSMData {
 	BLOCK_StateKinds state;
 	bool started;
 	uint8_t nof_processed_blocks;
+	bool valve_switched;			/* valve was switched in the current state */
+	volatile bool dwell;			/* waiting for the valve dwell timer */
 } BLOCK_FSMData;
 
 #define BLOCK_STACK_MAX_SIZE	10
+#define BLOCK_VALVE_DWELL_US	50000	/* time for the vacuum to build up / release */
 
 extern BLOCK_Object lim_position; 	/* Position that robot reaches in initialisation (lim switch) */
 extern BLOCK_Object home_position;	/* Position where robot is after init and on end */
@@ -51,3 +57,5 @@ BLOCK_Object BLOCK_GetSingle(uint8_t index);
 uint8_t BLOCK_GetSize(void);
 uint8_t BLOCK_GetState(void);
 void BLOCK_Clear(void);
+
+#endif /* BLOCKSTACK_H_ */
@@ -1,17 +1,29 @@
 #ifndef DATABASE_H_
 #define DATABASE_H_
 
-typedef enum {		/*   ID   Description        */
-	DB_MOT_ROTARY,
-	DB_MOT_KNEE,
-	DB_MOT_LIFT,
-	DB_DBGBUFFER,
-	DB_BLOCK_ZBLOCKHEIGHT,
-	DB_BLOCK_ZTARGETSURFACE,
-	DB_BLOCK_ZGROUNDSURFACE,
-	DB_BLOCK_LIMPOS,
-	DB_BLOCK_HOMEPOS,
-	DB_BLOCK_STACKPOS,
+#include "Motors.h"
+#include "BlockStack.h"
+
+/* Database schema, one line per variable. Everything else (ids, layout, 
+ * NVM offsets, serializers, schema hash) is generated from this table. 
+ * OnChange is called after the variable was written (or NULL). 
+ * The ids are stored in the NVM records: never renumber, append new ones! 
+ *	  Name						ID	Variable		Type			NVM		OnChange */
+#define DB_VARS(X) \
+	X(DB_MOT_ROTARY,			0,	rotary.p,		MOT,			TRUE,	MOT_OnParamChange) \
+	X(DB_MOT_KNEE,				1,	knee.p,			MOT,			TRUE,	MOT_OnParamChange) \
+	X(DB_MOT_LIFT,				2,	lift.p,			MOT,			TRUE,	MOT_OnParamChange) \
+	X(DB_DBGBUFFER,				3,	debugBuffer,	T_DBGBUFFER,	TRUE,	NULL) \
+	X(DB_BLOCK_ZBLOCKHEIGHT,	4,	zBlockHeight,	U16,			TRUE,	NULL) \
+	X(DB_BLOCK_ZTARGETSURFACE,	5,	zTargetSurface,	U16,			TRUE,	NULL) \
+	X(DB_BLOCK_ZGROUNDSURFACE,	6,	zGroundSurface,	U16,			TRUE,	NULL) \
+	X(DB_BLOCK_LIMPOS,			7,	lim_position,	POS,			TRUE,	NULL) \
+	X(DB_BLOCK_HOMEPOS,			8,	home_position,	POS,			TRUE,	NULL) \
+	X(DB_BLOCK_STACKPOS,		9,	stack_position,	POS,			TRUE,	NULL)
+
+#define DB_X_ID(name, id, var, type, nvm, hook)	name = id,
+typedef enum {
+	DB_VARS(DB_X_ID)
 	DB_NOF_VARS		/*!< Sentinel, must be last! */
 } DB_VarID;
 
@@ -23,20 +35,99 @@ typedef enum {
 	T_DBGBUFFER
 } DB_DataType;
 
+/* Storage size (RAM and NVM) and serial size of the data types */
+#define DB_SIZE_U8				sizeof(uint8_t)
+#define DB_SIZE_U16				sizeof(uint16_t)
+#define DB_SIZE_MOT				sizeof(MOT_PubData)
+#define DB_SIZE_POS				sizeof(BLOCK_Object)
+#define DB_SIZE_T_DBGBUFFER		SER_DEBUGBUFFER_LENGTH
+#define DB_WIRE_U8				1
+#define DB_WIRE_U16				2
+#define DB_WIRE_MOT				6
+#define DB_WIRE_POS				6
+#define DB_WIRE_T_DBGBUFFER		(SER_DEBUGBUFFER_LENGTH+1)
+
+typedef uint16_t DB_VarMask;		/* one bit per DB_VarID */
+#define DB_MASK(id)		((DB_VarMask) (1<<(id)))
+
+typedef void (*DB_PutFn)(uint8_t* buf, const void* var);	/* encode for serial */
+typedef void (*DB_GetFn)(const uint8_t* buf, void* var);	/* decode from serial */
+typedef void (*DB_ChangeFn)(void* var);						/* change hook */
+
 typedef struct DB_Var {
 	void* var_ptr;
 	DB_DataType type;
 	bool nvm;
+	uint8_t size;			/* DB_SIZE_<type> */
+	uint8_t wire_size;		/* DB_WIRE_<type> */
+	uint16_t offset;		/* offset in the NVM image */
+	DB_PutFn put;
+	DB_GetFn get;
+	DB_ChangeFn on_change;
+	const char* name;		/* variable name for schema introspection */
 } DB_Var;
 
-#define DB_NVM_BASE_ADDR		0x1FC00
+/* Record log (last 4 flash sectors). Each sector is a bank: header, image 
+ * of all variables, records appended by later saves. */
+#define DB_LOG_BASE_ADDR		0x1F000
+#define DB_LOG_NOF_SECTORS		4
+#define DB_LOG_SECTOR_SIZE		1024
+#define DB_LOG_MAGIC			0x4B424244					/* "DBBK" */
+#define DB_LOG_COMPACT_LEVEL	(DB_LOG_SECTOR_SIZE*3/4)	/* fill level to start compaction */
+#define DB_LOG_NO_SECTOR		0xFF
+#define DB_LOG_RECORD_SIZE(len)	((sizeof(DB_LogRecord)+(len)+3) & ~3)
+
+#define DB_NVM_BASE_ADDR		0x1FC00	/* old fixed image, imported if there is no log */
+#define DB_NVM_SIZE				256		/* bytes for the records of one save (multiple of 4) */
+
+typedef struct DB_LogSectorHeader {
+	uint32_t magic;			/* DB_LOG_MAGIC */
+	uint32_t seq;			/* incremented with every compaction */
+	uint16_t schema;		/* DB_GetSchemaHash() of the image */
+	uint16_t image_size;	/* bytes of the image following the header */
+	uint16_t crc;			/* CRC16 over seq, schema, image_size and image */
+	uint16_t reserved;
+} DB_LogSectorHeader;
+
+typedef struct DB_LogRecord {
+	uint8_t id;				/* DB_VarID */
+	uint8_t len;			/* length of the value following the record header */
+	uint16_t crc;			/* CRC16 over id, len and value */
+} DB_LogRecord;
+
+/* Big endian access to serial buffers */
+#define DB_PUT16(b,i,v)		do { (b)[i] = (uint8_t) ((v) >> 8); (b)[(i)+1] = (uint8_t) ((v) & 0xFF); } while(0)
+#define DB_GET16(b,i)		((uint16_t) (((b)[i]<<8) + (b)[(i)+1]))
 
 void DB_Init(void);
-void DB_RegisterVar(uint8_t varID, void* adr, DB_DataType type, bool eeprom);
 DB_DataType DB_GetType(uint8_t varID);
+const char* DB_GetName(uint8_t varID);
+uint8_t DB_GetSize(uint8_t varID);
+bool DB_IsNVM(uint8_t varID);
 void* DB_GetVar(uint8_t varID);
 uint8_t DB_GetVar_u8(uint8_t varID);
+bool DB_IsValid(uint8_t varID);
+uint8_t DB_GetWireSize(uint8_t varID);
+uint8_t DB_Serialize(uint8_t varID, uint8_t* buf);
+uint8_t DB_Deserialize(uint8_t varID, const uint8_t* buf);
+uint16_t DB_GetSchemaHash(void);
+void DB_SetDirty(uint8_t varID);
+void DB_NotifyChanges(DB_VarMask changed);
+DB_VarMask DB_GetDirty(void);
+void DB_GetLogState(uint8_t* sector, uint16_t* used);
+void DB_SetU8(uint8_t varID, uint8_t value);
+void DB_SetU16(uint8_t varID, uint16_t value);
+void DB_SetMot(uint8_t varID, const MOT_PubData* value);
+void DB_SetPos(uint8_t varID, const BLOCK_Object* value);
 void DB_LoadNVM(void);
+uint32_t DB_GetLoadTime(void);
 void DB_SaveNVM(void); 
+void DB_CompactNVM(void);
+void DB_StepNVM(void);
+void DB_OnWriteEnd(void);
+void DB_OnMotionIdle(void);
+bool DB_IsSaving(void);
+bool DB_SaveFailed(void);
+bool DB_LoadFailed(void);
 
 #endif
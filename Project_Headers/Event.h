@@ -7,6 +7,7 @@
  * This module implements a generic event driver. We are using numbered events starting with zero.
  * EVNT_HandleEvent() can be used to process the pending events. Note that the event with the number zero
  * has the highest priority and will be handled first.
+ * Setting and clearing an event never masks interrupts, events can be set from any ISR.
  */
 
 #ifndef EVENT_H_
@@ -17,11 +18,29 @@
 typedef enum EVNT_Handle {
 	EVNT_INIT,						/*!< System Initialisation Event */
 	EVNT_HEARTBEAT,
-	EVNT_SERIAL_CMD,
+	EVNT_SERIAL_CMD,				/*!< Queued, payload is the SER_FSMData* with the packet */
+	EVNT_MOT_ROTARY_DONE,			/*!< Axis reached MOT_FSM_STOP (set by the step interrupt) */
+	EVNT_MOT_KNEE_DONE,
+	EVNT_MOT_LIFT_DONE,
+	EVNT_MOT_IDLE,					/*!< All axes stand still */
+	EVNT_MOT_WATCH,					/*!< Axis passed the position set by MOT_WatchBelow() */
 	EVNT_SAVE_NVM,
+	EVNT_NVM_STEP,					/*!< Start the next flash operation of the NVM job */
+	EVNT_NVM_DONE,					/*!< NVM job finished (see DB_SaveFailed()) */
+	EVNT_NVM_COMPACT,				/*!< Move NVM log to the next sector (background) */
 	EVNT_NOF_EVENTS					/*!< Sentinel only, must be last one */
 } EVNT_Handle;
 
+/* Priorities of the event queue, each has its own ring buffer */
+typedef enum EVNT_Prio {
+	EVNT_PRIO_HIGH,
+	EVNT_PRIO_NORMAL,
+	EVNT_PRIO_LOW,
+	EVNT_NOF_PRIOS					/*!< Sentinel only, must be last one */
+} EVNT_Prio;
+
+#define EVNT_QUEUE_LENGTH	8		/*!< Entries per priority, power of two */
+
 
 /*! \brief Event module initialization */
 void EVNT_Init(void);
@@ -51,5 +70,32 @@ bool EVNT_EventIsSet(EVNT_Handle event);
  */
 void EVNT_HandleEvent(void (*callback)(EVNT_Handle));
 
+/*!
+ * \brief Queues an event with a payload. Unlike the flags, every posted event is delivered.
+ * \param[in] event The handle of the event.
+ * \param[in] prio Priority, selects the ring buffer.
+ * \param[in] payload Data passed to the callback (value or pointer).
+ * \return TRUE if queued, FALSE if the ring buffer was full (counted as dropped).
+ */
+bool EVNT_PostEvent(EVNT_Handle event, EVNT_Prio prio, uint32_t payload);
+
+/*!
+ * \brief Delivers the oldest queued event of the highest priority.
+ * \param[in] callback Callback routine, gets the event handle and the payload.
+ * \return TRUE if an event was delivered.
+ */
+bool EVNT_HandleQueue(void (*callback)(EVNT_Handle, uint32_t));
+
+/*!
+ * \brief Returns the number of events dropped because a ring buffer was full.
+ * \param[in] prio Priority of the ring buffer.
+ */
+uint16_t EVNT_GetDropped(EVNT_Prio prio);
+
+/*!
+ * \brief Returns TRUE if no event flag is set and all queues are empty.
+ */
+bool EVNT_IsIdle(void);
+
 
 #endif /* EVENT_H_ */
@@ -21,6 +21,10 @@
 #define KNEE	2
 #define LIFT	3
 
+// SIG ticks from MOT_Commit() to the first step, enough to load all channels
+#define MOT_START_DELAY		10
+#define MOT_NO_SKEW			0xFFFF	/* MOT_GetStartSkew() before the axes made their first step */
+
 // Define Motor Directions
 #define CCW		0
 #define CW		1
@@ -64,6 +68,13 @@ typedef struct MOT_FSMData {
 	int16_t last_accel_delay;
 	uint16_t rest;
 	uint16_t position;
+	bool recalc_pending;		// parameters changed while running
+	bool armed;					// prepared, starts with the next MOT_Commit()
+	bool done_pending;			// prepared with zero steps, MOT_Commit() signals done
+	bool first_step;			// committed, first step not done yet
+	uint16_t start_latency;		// SIG ticks from the common start edge to the first step
+	bool watching;				// EVNT_MOT_WATCH when position gets below watch_below
+	uint16_t watch_below;
 
 	/* setpoints */
 	uint16_t step_count;		// ok
@@ -102,7 +113,13 @@ bool MOT_GetFaultState(MOT_FSMData* m_);
 uint8_t MOT_GetState(MOT_FSMData* m_);
 void MOT_CalcValues(MOT_FSMData* m_, uint16_t accel, uint16_t decel, uint16_t speed);
 void MOT_RecalcValues(MOT_FSMData* m_);
+void MOT_OnParamChange(void* var);
+void MOT_OnAxisDone(MOT_FSMData* m_);
+void MOT_PrepareSteps(MOT_FSMData* m_, int16_t steps);
+void MOT_Commit(void);
 void MOT_MoveSteps(MOT_FSMData* m_, int16_t steps);
+uint16_t MOT_GetStartSkew(void);
+void MOT_WatchBelow(MOT_FSMData* m_, uint16_t position);
 uint16_t MOT_Process(MOT_FSMData* m_);
 
 #endif /* MOTORS_H_ */
@@ -38,6 +38,7 @@ uint8_t ROB_GetRunMode(void);
 uint16_t ROB_GetStateArray(void);
 void ROB_Start(void);
 void ROB_Process(void);
+bool ROB_IsRunning(void);
 bool ROB_Moving(void);
 void ROB_MoveToZ(uint16_t z);
 void ROB_MoveToXY(uint16_t x, uint16_t y);
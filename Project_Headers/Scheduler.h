@@ -0,0 +1,69 @@
+/**
+ * \file
+ * \brief Scheduler Module interface.
+ * \author Christoph Bächler
+ */
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include "PE_Types.h"
+
+/*! \brief Tasks of the main loop */
+typedef enum {
+	SCHED_EVENTS,		/*!< event flags and queue */
+	SCHED_TRIGGERS,		/*!< deferred trigger callbacks */
+	SCHED_ROBOT,		/*!< robot and pick and place FSM */
+	SCHED_JOBS,			/*!< completion of sequenced requests */
+	SCHED_NOF_TASKS		/*!< Must be last! */
+} SCHED_TaskKind;
+
+#define SCHED_PRIO_HIGH		0		/*!< lower number runs first */
+#define SCHED_ON_DEMAND		0xFFFF	/*!< period of a task that only runs after SCHED_Wake() */
+
+/*! \brief Task function, runs to completion */
+typedef void (*SCHED_Task)(void);
+
+/*! \brief Per-task statistics, times in SIG ticks (2.67 us) */
+typedef struct SCHED_Stats {
+	uint8_t cpu;			/*!< share of the CPU time in percent */
+	uint16_t max;			/*!< longest run */
+	uint16_t overruns;		/*!< runs longer than the budget */
+	uint16_t late;			/*!< releases while the last one did not run yet */
+} SCHED_Stats;
+
+/*!
+ * \brief Registers a task.
+ * \param task Task to register
+ * \param fn Function of the task
+ * \param prio Priority, SCHED_PRIO_HIGH runs first
+ * \param period_ms Period, 0 runs the task on every pass of the main loop, SCHED_ON_DEMAND never
+ * \param budget_us Longest time the task should run, longer runs count as overrun
+ * \return error code, ERR_OK if everything is fine
+ */
+uint8_t SCHED_AddTask(SCHED_TaskKind task, SCHED_Task fn, uint8_t prio, uint16_t period_ms, uint16_t budget_us);
+
+/*!
+ * \brief Makes a task ready to run on the next pass, also a periodic or on demand one.
+ * Can be called from interrupts.
+ * \param task Task to wake
+ */
+void SCHED_Wake(SCHED_TaskKind task);
+
+/*! \brief Runs all ready tasks once, in the order of their priority. */
+void SCHED_Run(void);
+
+/*! \brief Sleeps until the next interrupt if no periodic or on demand task is ready. */
+void SCHED_Idle(void);
+
+/*!
+ * \brief Returns the statistics of all tasks and starts a new measurement window.
+ * The overrun and late counters are not reset.
+ * \param stats One entry per SCHED_TaskKind
+ */
+void SCHED_GetStats(SCHED_Stats stats[SCHED_NOF_TASKS]);
+
+/*!\brief Initializes the module, call after TRG_Init(). */
+void SCHED_Init(void);
+
+#endif /* SCHEDULER_H_ */
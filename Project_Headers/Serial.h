@@ -11,6 +11,9 @@
 /* Define protocol */
 #define SER_START 				'['
 #define SER_END					']'
+#define SER_START_SEQ			'{'		/* frame with sequence id after the command byte */
+#define SER_END_SEQ				'}'
+#define SER_FRAME_OVERHEAD		5		/* start, length, command, checksum, end */
 
 #define SER_MODE				'M'
 #define SER_RUN					'R'
@@ -29,53 +32,102 @@
 #define SER_DEBUG_PACKET		'd'
 #define SER_READ_VARIABLE		'r'
 #define SER_SAVE_NVM 			's'
+#define SER_NVM_STATUS			'n'		/* unsaved variables, log fill level, load and boot time (us, 32 bit), load failed */
 #define SER_WRITE_VARIABLE		'w'
+#define SER_READ_VARIABLES		'g'		/* bulk read: list of variable ids */
+#define SER_WRITE_VARIABLES		'p'		/* bulk write: list of (id, value) */
+#define SER_SCHEMA_HASH			'h'		/* hash of the database schema and number of variables */
+#define SER_SCHEMA_VARIABLE		'i'		/* description of one database variable */
+#define SER_EVENT_STATUS		'e'		/* dropped events per priority and dropped packets */
+#define SER_TIMER_STATUS		't'		/* tick interrupt time, trigger pool usage, overruns, idle */
+#define SER_TASK_STATUS			'l'		/* cpu load, longest run, overruns and late releases per task */
+
+#define SER_COMPLETE			'c'		/* asynchronous completion of a sequenced request */
+#define SER_STATUS_OK			0
+#define SER_STATUS_REJECTED		1		/* too many requests outstanding */
+#define SER_STATUS_INVALID		2		/* malformed request, nothing applied */
+#define SER_STATUS_FAILED		3		/* request accepted but could not be finished */
+
+#define SER_DATA_LENGTH			64		/* maximum number of data bytes per packet */
+#define SER_RX_QUEUE_LENGTH		4		/* received packets per port (one slot is kept free) */
 
 #define SER_DEBUGBUFFER_LENGTH	30
 
+/* Second protocol engine on the Serial1 component (enable together with the component) */
+//#define SER_SERIAL1
+
+/* Receive DBG (UART0) by DMA instead of one interrupt per byte */
+#define SER_RX_DMA
+#define SER_RX_BUFFER_SIZE		256			/* ring size, power of two */
+#define SER_RX_DMA_DMOD			5			/* DMOD setting for 256 byte ring */
+#define SER_RX_DMA_SOURCE		2			/* DMAMUX source UART0 receive */
+#define SER_RX_DMA_BCR			0xFFFF0		/* byte count, re-armed in SER_RxPoll() */
+#define SER_RX_IDLE_TICKS		9			/* SIG ticks of one idle character at 460800 baud, before IDLE is set */
+
 typedef enum SER_StateKinds {
 	SER_FSM_START, 
 	SER_FSM_LENGTH,
 	SER_FSM_COMMAND,
+	SER_FSM_SEQUENCE,
 	SER_FSM_DATA,
 	SER_FSM_CHECKSUM,
-	SER_FSM_STOP,
-	SER_FSM_BUSY
+	SER_FSM_STOP
 } SER_StateKinds;
 
 typedef struct SER_Packet {
 	uint8_t command;
-	uint8_t data[32];
+	uint8_t data[SER_DATA_LENGTH];
 	uint8_t data_index;
 	uint8_t length;
 	uint8_t checksum;	
+	uint8_t seq;
+	bool sequenced;
+	uint32_t arrival;	// SIG ticks (TMR_GetTicks()) by which the last byte had arrived
 } SER_Packet;
 
 typedef struct SER_FSMData {
 	SER_StateKinds state;
-	SER_Packet input_packet;
+	SER_Packet input_packet[SER_RX_QUEUE_LENGTH];	// received requests, handled from rx_head
+	uint8_t rx_head;
+	uint8_t rx_tail;
+	uint8_t rx_dropped;
 	SER_Packet output_packet;
 	byte (*ReceiveChar)(uint8_t *ch);
 	byte (*SendChar)(uint8_t ch);
 } SER_FSMData;
 
-#define SER_GetData8(i)		(SER_GetData()[i])
-#define	SER_GetData16(i)	((SER_GetData()[i]<<8)+SER_GetData()[i+1])
+#define SER_GetData8(p,i)	(SER_GetData(p)[i])
+#define	SER_GetData16(p,i)	((SER_GetData(p)[i]<<8)+SER_GetData(p)[i+1])
 
 extern uint8_t debugBuffer[SER_DEBUGBUFFER_LENGTH+1];
 
+extern SER_FSMData SER_Dbg;			/* OpenSDA (UART0) */
+#ifdef SER_SERIAL1
+extern SER_FSMData SER_Serial1;		/* Serial1 component */
+#endif
+
 void SER_Init(void);
-void SER_Process(void);
+void SER_Process(SER_FSMData* port);
+void SER_RxDMAInit(void);
+void SER_RxPoll(void);
+void SER_RxIdleLine(void);
+void SER_GetRxLatency(uint16_t* last, uint16_t* max);
 void SER_ResetDebugBuffer(void);
-void SER_SetHandled(void);
-uint8_t* SER_GetLength(void);
-uint8_t* SER_GetCommand(void);
-uint8_t* SER_GetData(void);
-bool SER_TestChecksum(void);
-void SER_AddData8(uint8_t d);
-void SER_AddData16(uint16_t d);
-uint8_t SER_BuildChecksum(void);
-void SER_SendChar(uint8_t ch);
-void SER_SendPacket(uint8_t command);
+void SER_SetHandled(SER_FSMData* port);
+uint8_t* SER_GetLength(SER_FSMData* port);
+uint8_t SER_GetDataLength(SER_FSMData* port);
+uint8_t SER_GetSequence(SER_FSMData* port);
+bool SER_IsSequenced(SER_FSMData* port);
+uint8_t* SER_GetCommand(SER_FSMData* port);
+uint8_t* SER_GetData(SER_FSMData* port);
+bool SER_TestChecksum(SER_FSMData* port);
+void SER_AddData8(SER_FSMData* port, uint8_t d);
+void SER_AddData16(SER_FSMData* port, uint16_t d);
+void SER_AddDataN(SER_FSMData* port, const uint8_t* d, uint8_t n);
+uint8_t SER_GetFreeSpace(SER_FSMData* port);
+uint8_t SER_BuildChecksum(SER_FSMData* port);
+void SER_SendChar(SER_FSMData* port, uint8_t ch);
+void SER_SendPacket(SER_FSMData* port, uint8_t command);
+void SER_SendComplete(SER_FSMData* port, uint8_t seq, uint8_t command, uint8_t status);
 
 #endif
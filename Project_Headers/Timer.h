@@ -8,9 +8,70 @@
 #ifndef TIMER_H_
 #define TIMER_H_
 
+#include "PE_Types.h"
+
 #define TMR_TICK_MS 1
 
 /*! \brief Function called from timer interrupt every TMR_TICK_MS. */
 void TMR_OnInterrupt(void);
 
+/*!
+ * \brief Returns the time spent in the tick interrupt, in SIG ticks (2.67 us).
+ * \param last Duration of the last tick
+ * \param max Longest tick since the last call (reset by this call)
+ */
+void TMR_GetTickTime(uint16_t* last, uint16_t* max);
+
+/* Monotonic timebase: SIG counter (TPM0, 375 kHz) extended by counting its overflows */
+#define TMR_TICKS_TO_US(t)		(((t)*8)/3)
+
+/*! \brief SIG counter overflow, called from SIG_OnCounterRestart. */
+void TMR_OnCounterRestart(void);
+
+/*! \brief Returns the SIG ticks since power up (2.67 us). Callable from interrupts. */
+uint64_t TMR_GetTicks(void);
+
+/*! \brief Returns the microseconds since power up. Callable from interrupts. */
+uint64_t TMR_GetMicros(void);
+
+/*!
+ * \brief Sleeps (WFI) until the next interrupt if no event or deferred trigger is pending.
+ * While no trigger expires in the next ticks, the tick interrupt is slowed down
+ * (at most 4 ms with SER_RX_DMA, below the fill time of the receive ring) and the
+ * skipped ticks are caught up; a one-shot timer wakes the core for earlier triggers.
+ * With SER_RX_DMA the UART idle-line interrupt also wakes it at the end of a request.
+ */
+void TMR_Idle(void);
+
+/*! \brief Takes the tick timer setting used by TMR_Idle(), call after PE_low_level_init(). */
+void TMR_Init(void);
+
+/*!
+ * \brief Returns the idle statistics and starts a new measurement window.
+ * \param percent Time spent sleeping since the last call
+ */
+void TMR_GetIdleStats(uint8_t* percent);
+
+/* One-shot timers with SIG tick resolution (375 kHz, 2.67 us) on TPM0 channel 3.
+ * Delays are limited to half the counter range, use Trigger for longer ones. */
+#define TMR_NOF_ONESHOTS		8
+#define TMR_NO_ONESHOT			0xFF
+#define TMR_US_TO_TICKS(us)		((uint16_t) (((uint32_t)(us)*3)/8))
+#define TMR_ONESHOT_MAX_US		87000	/* 0x7FFF ticks */
+
+typedef void (*TMR_Callback)(void* data);
+
+/*!
+ * \brief Calls cb(data) from the SIG interrupt after us microseconds.
+ * \param us Delay (at most TMR_ONESHOT_MAX_US)
+ * \return Handle for TMR_CancelOneShot() or TMR_NO_ONESHOT if none is free
+ */
+uint8_t TMR_StartOneShot(uint32_t us, TMR_Callback cb, void* data);
+
+/*! \brief Cancels a pending one-shot timer (no effect if it already fired). */
+void TMR_CancelOneShot(uint8_t handle);
+
+/*! \brief Compare match on TPM0 channel 3, called from SIG_OnChannel3. */
+void TMR_OnCompare(void);
+
 #endif /* TIMER_H_ */
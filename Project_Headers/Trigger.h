@@ -19,9 +19,18 @@ typedef enum {
 	TRG_LED_BLINK, 	    /*!< LED blinking */
 	TRG_KEY_POLL,		/*!< Key Poll */
 	TRG_BLUE_LED_OFF,
+	TRG_NVM_RETRY,		/*!< NVM job waits for a busy flash controller */
 	TRG_NOF_TRIGGERS 	/*!< Must be last! */
 } TRG_TriggerKind;
 
+/*! \brief Handle of a trigger: a TRG_TriggerKind or an entry from TRG_Alloc() */
+typedef uint8_t TRG_Handle;
+
+#ifndef TRG_POOL_SIZE
+#define TRG_POOL_SIZE	16		/*!< Triggers in the pool, including the TRG_TriggerKind ones (max. 32) */
+#endif
+#define TRG_NO_HANDLE	0xFF	/*!< Returned if the pool is exhausted */
+
 /*! \brief Type for the data pointer used by the callback */
 typedef void *TRG_CallBackDataPtr;
 
@@ -31,6 +40,12 @@ typedef void (*TRG_Callback)(TRG_CallBackDataPtr);
 /*! \brief Type to hold the trigger ticks */
 typedef uint16_t TRG_TriggerTime;
 
+/*! \brief Context a trigger callback runs in */
+typedef enum {
+	TRG_DEFERRED,		/*!< from TRG_Process() in the main loop (default) */
+	TRG_ISR				/*!< directly in the tick interrupt, keep it short! */
+} TRG_Mode;
+
 /*!
  * \brief Adds a new trigger
  * \param trigger Trigger to be added
@@ -39,12 +54,99 @@ typedef uint16_t TRG_TriggerTime;
  * \param data Optional pointer to data
  * \return error code, ERR_OK if everything is fine
  */
-uint8_t TRG_SetTrigger(TRG_TriggerKind trigger, TRG_TriggerTime ticks,
+uint8_t TRG_SetTrigger(TRG_Handle trigger, TRG_TriggerTime ticks,
+		TRG_Callback callback, TRG_CallBackDataPtr data);
+
+/*!
+ * \brief Adds a periodic trigger. It is reloaded at the tick it fires, so it does not drift
+ * \param trigger Trigger to be added
+ * \param ticks Ticks until the first call, relative from the current time
+ * \param period Ticks between the calls, must not be 0
+ * \param callback Callback to be called every period
+ * \param data Optional pointer to data
+ * \return error code, ERR_OK if everything is fine
+ */
+uint8_t TRG_SetPeriodic(TRG_Handle trigger, TRG_TriggerTime ticks, TRG_TriggerTime period,
 		TRG_Callback callback, TRG_CallBackDataPtr data);
 
+/*!
+ * \brief Returns how often a deferred trigger fired again before its callback had run.
+ * \param trigger Trigger to check
+ */
+uint16_t TRG_GetOverruns(TRG_Handle trigger);
+
+/*!
+ * \brief Selects the context the callback of a trigger runs in.
+ * \param trigger Trigger to configure
+ * \param mode TRG_DEFERRED or TRG_ISR
+ */
+void TRG_SetMode(TRG_Handle trigger, TRG_Mode mode);
+
+/*!
+ * \brief Takes a trigger from the pool. It is deferred and not armed until TRG_SetTrigger()
+ * or TRG_SetPeriodic() is called.
+ * \return Handle, TRG_NO_HANDLE if the pool is exhausted
+ */
+TRG_Handle TRG_Alloc(void);
+
+/*!
+ * \brief Stops a trigger and gives it back to the pool.
+ * \param trigger Handle from TRG_Alloc()
+ */
+void TRG_Free(TRG_Handle trigger);
+
+/*!
+ * \brief Allocates a one-shot trigger that goes back to the pool after its callback ran.
+ * \param ticks Trigger time in ticks, relative from the current time
+ * \param callback Callback to be called when the trigger fires
+ * \param data Optional pointer to data
+ * \return Handle (only valid until the callback ran), TRG_NO_HANDLE if the pool is exhausted
+ */
+TRG_Handle TRG_StartOnce(TRG_TriggerTime ticks, TRG_Callback callback, TRG_CallBackDataPtr data);
+
+/*!
+ * \brief Stops a trigger, a callback that is due but did not run yet is dropped as well.
+ * \param trigger Trigger to stop
+ */
+void TRG_Cancel(TRG_Handle trigger);
+
+/*!
+ * \brief Moves an active trigger to a new time, callback and period are kept.
+ * \param trigger Trigger to move
+ * \param ticks New trigger time in ticks, relative from the current time
+ * \return ERR_OK, ERR_NOTAVAIL if the trigger is not active
+ */
+uint8_t TRG_Reschedule(TRG_Handle trigger, TRG_TriggerTime ticks);
+
+/*!
+ * \brief Returns the pool usage.
+ * \param used Entries allocated now
+ * \param max_used Most entries allocated at the same time
+ * \param failed Allocations that failed because the pool was exhausted
+ */
+void TRG_GetPoolStats(uint8_t* used, uint8_t* max_used, uint16_t* failed);
+
 /*! \brief Called from interrupt service routine with a period of TRG_TICKS_MS. */
 void TRG_IncTick(void);
 
+#define TRG_NO_EXPIRY	0xFFFF	/*!< TRG_TicksToNext() without an active trigger */
+
+/*! \brief Returns the ticks until the next trigger fires, TRG_NO_EXPIRY if none is active. */
+TRG_TriggerTime TRG_TicksToNext(void);
+
+/*!
+ * \brief Catches up with ticks that were suppressed while the core was sleeping.
+ * Same as calling TRG_IncTick() ticks times, but only the ticks with an expiry cost time.
+ * \param ticks Elapsed ticks
+ */
+void TRG_AddTicks(TRG_TriggerTime ticks);
+
+/*! \brief Returns TRUE if no deferred callback is waiting for TRG_Process(). */
+bool TRG_IsIdle(void);
+
+/*! \brief Runs the callbacks of the deferred triggers that are due, called from the main loop. */
+void TRG_Process(void);
+
 /*!\brief De-initializes the module. */
 void TRG_Deinit(void);
 
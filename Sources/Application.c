@@ -12,6 +12,8 @@
  * the source of an event. 
  */
 
+#include <string.h>
+#include "Cpu.h"
 #include "PE_Types.h"
 #include "Application.h"
 #include "Database.h"
@@ -19,6 +21,7 @@
 #include "Event.h"
 #include "Motors.h"
 #include "Trigger.h"
+#include "Scheduler.h"
 #include "BlockStack.h"
 #include "Serial.h"
 #include "WAIT.h"
@@ -32,8 +35,28 @@
 #include "SW1.h"
 #include "VALVE.h"
 
+/*! \brief Sequenced request waiting for its SER_COMPLETE message. */
+typedef struct APP_Job {
+	SER_FSMData* port;		/* port the request came from */
+	uint8_t seq;			/* sequence id of the request */
+	uint8_t command;		/* command code of the request */
+} APP_Job;
+
+#define APP_NOF_JOBS	4
+
+static APP_Job jobs[APP_NOF_JOBS];
+static uint8_t nof_jobs;
+
+static uint32_t boot_us;		/* us from PE_low_level_init() to the first loop iteration */
+
 /* local prototypes (static functions) */
+static void APP_HandleEvents(void);
 static void APP_HandleEvent(EVNT_Handle event);
+static void APP_HandleQueuedEvent(EVNT_Handle event, uint32_t payload);
+static void APP_HandleSerialCmd(SER_FSMData* port);
+static void APP_AddJob(SER_FSMData* port);
+static uint8_t APP_WriteVariables(SER_FSMData* port);
+static void APP_CheckJobs(void);
 static void APP_Blink(void *p);
 static void APP_KeyPoll(void *p);
 static void APP_BlueLedOff(void *p);
@@ -43,12 +66,20 @@ static void APP_BlueLedOff(void *p);
  * This function does the initialisation of hardware and data structures. 
  */
 void APP_Init(void) {
+	TMR_Init();
 	DB_Init();
     EVNT_Init();
     TRG_Init();
     SER_Init();
     MOT_Init();
     ROB_Init();
+    
+    SCHED_Init();
+    /*            task            function          prio  period ms        budget us */
+    SCHED_AddTask(SCHED_EVENTS,   APP_HandleEvents, 0,    0,               500);
+    SCHED_AddTask(SCHED_TRIGGERS, TRG_Process,      1,    0,               200);
+    SCHED_AddTask(SCHED_ROBOT,    ROB_Process,      2,    SCHED_ON_DEMAND, 500);
+    SCHED_AddTask(SCHED_JOBS,     APP_CheckJobs,    3,    10,              200);
 }
 
 /*! \brief Application main loop.
@@ -61,23 +92,24 @@ void APP_Loop(void) {
 	lift.position = 0;
 	LED_S2_On();
 	EVNT_SetEvent(EVNT_INIT);
+	boot_us = (uint32_t) TMR_GetMicros();	// timebase starts with SIG in PE_low_level_init()
 	
     while(1) {
-        // Task 1: Handle Events
-        EVNT_HandleEvent(APP_HandleEvent);
-
-        // Task 2: Handle Picking 
-        ROB_Process();
-        
-        // Further Tasks...
+        SCHED_Run();
+        SCHED_Idle();
     }
 }
 
+/*! \brief Event task: one event flag and one queued event per pass. */
+static void APP_HandleEvents(void) {
+    EVNT_HandleEvent(APP_HandleEvent);
+    EVNT_HandleQueue(APP_HandleQueuedEvent);
+}
+
 static void APP_Blink(void *p) {
 	LED_S1_Neg();
 	LED_S2_Neg();
 	LED_ER_Neg();
-	TRG_SetTrigger(TRG_LED_BLINK, 1000, APP_Blink, NULL);
 }
 
 static void APP_KeyPoll(void *p) {
@@ -93,14 +125,118 @@ static void APP_KeyPoll(void *p) {
 	else {
 		debounce_cnt = 0;
 	}
-	
-	TRG_SetTrigger(TRG_KEY_POLL, 10, APP_KeyPoll, NULL);
 }
 
 static void APP_BlueLedOff(void *p) {
 	LED_BLUE_Off();
 }
 
+/*! \brief Writes a list of (id, value) pairs to the database.
+ *
+ * The whole list is checked first, then all values are written with 
+ * interrupts disabled so no one ever sees half of a parameter set. 
+ * The change hooks run afterwards, only for the written variables. 
+ *
+ *  \param port  Port the request was received on.
+ *  \return SER_STATUS_OK or SER_STATUS_INVALID (nothing written)
+ */
+static uint8_t APP_WriteVariables(SER_FSMData* port) {
+	uint8_t pos, id;
+	DB_VarMask touched;
+	
+	// check list
+	pos = 0;
+	while(pos < SER_GetDataLength(port)) {
+		id = SER_GetData8(port, pos);
+		if(!DB_IsValid(id) || DB_GetType(id) == T_DBGBUFFER) {
+			return SER_STATUS_INVALID;
+		}
+		pos += 1 + DB_GetWireSize(id);
+	}
+	if(pos != SER_GetDataLength(port)) {
+		return SER_STATUS_INVALID;
+	}
+	
+	// apply list
+	touched = 0;
+	pos = 0;
+	EnterCritical();
+	while(pos < SER_GetDataLength(port)) {
+		id = SER_GetData8(port, pos);
+		pos += 1 + DB_Deserialize(id, &SER_GetData8(port, pos+1));
+		touched |= DB_MASK(id);
+	}
+	ExitCritical();
+	
+	DB_NotifyChanges(touched);
+	return SER_STATUS_OK;
+}
+
+/*! \brief Registers the current (long running) request for completion.
+ *
+ * Only sequenced requests are tracked, legacy hosts never get a 
+ * SER_COMPLETE message. If all job slots are used the request is 
+ * completed right away with SER_STATUS_REJECTED. 
+ *
+ *  \param port  Port the request was received on.
+ */
+static void APP_AddJob(SER_FSMData* port) {
+	if(!SER_IsSequenced(port)) {
+		return;
+	}
+	if(nof_jobs >= APP_NOF_JOBS) {
+		SER_SendComplete(port, SER_GetSequence(port), *SER_GetCommand(port), SER_STATUS_REJECTED);
+		return;
+	}
+	jobs[nof_jobs].port = port;
+	jobs[nof_jobs].seq = SER_GetSequence(port);
+	jobs[nof_jobs].command = *SER_GetCommand(port);
+	nof_jobs++;
+}
+
+/*! \brief Sends SER_COMPLETE for every job that has finished.
+ *
+ * A move is finished as soon as all axes stand still, a run request 
+ * as soon as the robot went back to idle, a save as soon as the data 
+ * is in flash. Runs every 10 ms and right after EVNT_MOT_IDLE and 
+ * EVNT_NVM_DONE. 
+ */
+static void APP_CheckJobs(void) {
+	uint8_t i, status;
+	bool done;
+	
+	i = 0;
+	while(i < nof_jobs) {
+		status = SER_STATUS_OK;
+		switch(jobs[i].command) {
+			case SER_MOVETO_POSITION:
+				done = !ROB_Moving();
+				break;
+			case SER_RUN:
+				done = !ROB_IsRunning();
+				break;
+			case SER_SAVE_NVM:
+				done = !DB_IsSaving();
+				if(DB_SaveFailed()) {
+					status = SER_STATUS_FAILED;
+				}
+				break;
+			default:
+				done = TRUE;
+				break;
+		}
+		
+		if(done) {
+			SER_SendComplete(jobs[i].port, jobs[i].seq, jobs[i].command, status);
+			nof_jobs--;
+			jobs[i] = jobs[nof_jobs];		// keep list packed
+		}
+		else {
+			i++;
+		}
+	}
+}
+
 /*! \brief Event handler routine.
  *
  * This is implemented as described in INTRO script by Erich Styger. Basically 
@@ -110,16 +246,13 @@ static void APP_BlueLedOff(void *p) {
  *  \param event  Event handle.
  */
 static void APP_HandleEvent(EVNT_Handle event) {
-	uint8_t i;
-	BLOCK_Object block;
-	
     switch(event) {
         case EVNT_INIT: 
 			LED_BLUE_On();
 			WAIT_Waitms(500);
 			LED_BLUE_Off();
-			TRG_SetTrigger(TRG_LED_BLINK, 500, APP_Blink, NULL);
-			TRG_SetTrigger(TRG_KEY_POLL, 10, APP_KeyPoll, NULL);
+			TRG_SetPeriodic(TRG_LED_BLINK, 500, 1000, APP_Blink, NULL);
+			TRG_SetPeriodic(TRG_KEY_POLL, 10, 10, APP_KeyPoll, NULL);
             break;
             
         case EVNT_HEARTBEAT:
@@ -129,163 +262,298 @@ static void APP_HandleEvent(EVNT_Handle event) {
         case EVNT_SAVE_NVM:
         	LED_BLUE_On();
         	DB_SaveNVM();
+        	break;
+        	
+        case EVNT_NVM_STEP:
+        	DB_StepNVM();
+        	break;
+        	
+        case EVNT_NVM_DONE:
         	TRG_SetTrigger(TRG_BLUE_LED_OFF, 1000, APP_BlueLedOff, NULL);
+        	SCHED_Wake(SCHED_JOBS);
         	break;
+        	
+        case EVNT_MOT_ROTARY_DONE:
+        	MOT_OnAxisDone(&rotary);
+        	SCHED_Wake(SCHED_ROBOT);
+        	break;
+        	
+        case EVNT_MOT_KNEE_DONE:
+        	MOT_OnAxisDone(&knee);
+        	SCHED_Wake(SCHED_ROBOT);
+        	break;
+        	
+        case EVNT_MOT_LIFT_DONE:
+        	MOT_OnAxisDone(&lift);
+        	SCHED_Wake(SCHED_ROBOT);
+        	break;
+        	
+        case EVNT_MOT_WATCH:
+        	SCHED_Wake(SCHED_ROBOT);
+        	break;
+        	
+        case EVNT_MOT_IDLE:
+        	DB_OnMotionIdle();
+        	SCHED_Wake(SCHED_ROBOT);
+        	SCHED_Wake(SCHED_JOBS);		// finish move requests right away
+        	break;
+        	
+        case EVNT_NVM_COMPACT:
+        	DB_CompactNVM();
+        	break;
+
+        default:
+            break;
+    }
+}
+
+/*! \brief Handler for the queued events.
+ *
+ * Every posted event arrives here once, together with its payload. 
+ *
+ *  \param event    Event handle.
+ *  \param payload  Data given to EVNT_PostEvent().
+ */
+static void APP_HandleQueuedEvent(EVNT_Handle event, uint32_t payload) {
+	SER_FSMData* port;
+	
+	switch(event) {
+		case EVNT_SERIAL_CMD:
+			port = (SER_FSMData*) payload;
+			APP_HandleSerialCmd(port);
+			SER_SetHandled(port);
+			break;
+			
+		default:
+			break;
+	}
+}
 
-        case EVNT_SERIAL_CMD:
-        	switch(*SER_GetCommand()) {	
-                /** Main Commands **/
-                case SER_MODE:
-                    ROB_SetRunMode(SER_GetData8(0));
-                    SER_SendPacket(SER_MODE);
-                    break;
+/*! \brief Serial command handler.
+ *
+ * Executes the command of the packet received on the given port. The 
+ * answer is sent back on the same port. 
+ *
+ *  \param port  Port the packet was received on.
+ */
+static void APP_HandleSerialCmd(SER_FSMData* port) {
+	uint8_t i, id;
+	uint8_t buf[SER_DEBUGBUFFER_LENGTH+1];
+	BLOCK_Object block;
 
-                case SER_RUN:
-                    ROB_Start();
-                    SER_SendPacket(SER_RUN);
-                    break;
+	switch(*SER_GetCommand(port)) {	
+		/** Main Commands **/
+		case SER_MODE:
+			ROB_SetRunMode(SER_GetData8(port, 0));
+			SER_SendPacket(port, SER_MODE);
+			break;
 
-                case SER_MOVETO_POSITION:
-                    ROB_MoveToXYZ(SER_GetData16(0), SER_GetData16(2), SER_GetData16(4));
-                    SER_SendPacket(SER_MOVETO_POSITION);
-                    break;
+		case SER_RUN:
+			ROB_Start();
+			SER_SendPacket(port, SER_RUN);
+			APP_AddJob(port);
+			break;
 
-                case SER_PUSH_BLOCK_SINGLE:
-                    block.x = SER_GetData16(0);
-                    block.y = SER_GetData16(2);
-                    BLOCK_Push(block);
-                    SER_SendPacket(SER_PUSH_BLOCK_SINGLE);
-                    break;
+		case SER_MOVETO_POSITION:
+			ROB_MoveToXYZ(SER_GetData16(port, 0), SER_GetData16(port, 2), SER_GetData16(port, 4));
+			SER_SendPacket(port, SER_MOVETO_POSITION);
+			APP_AddJob(port);
+			break;
 
-                case SER_PUSH_BLOCK_ARRAY:
-                    for(i=0; i<((*SER_GetLength())-5)/4; i++) {
-                        block.x = SER_GetData16(4*i);
-                        block.y = SER_GetData16(4*i+2);
-                        BLOCK_Push(block);
-                    }
-                    SER_SendPacket(SER_PUSH_BLOCK_ARRAY);           
-                    break;
+		case SER_PUSH_BLOCK_SINGLE:
+			block.x = SER_GetData16(port, 0);
+			block.y = SER_GetData16(port, 2);
+			BLOCK_Push(block);
+			SER_SendPacket(port, SER_PUSH_BLOCK_SINGLE);
+			break;
 
-                case SER_GET_POSITION:
-                    SER_AddData16(rotary.position);
-                    SER_AddData16(knee.position);
-                    SER_AddData16(lift.position);
-                    SER_SendPacket(SER_GET_POSITION);
-                    break;
+		case SER_PUSH_BLOCK_ARRAY:
+			for(i=0; i<SER_GetDataLength(port)/4; i++) {
+				block.x = SER_GetData16(port, 4*i);
+				block.y = SER_GetData16(port, 4*i+2);
+				BLOCK_Push(block);
+			}
+			SER_SendPacket(port, SER_PUSH_BLOCK_ARRAY);           
+			break;
 
-				/** Configuration Commands **/
-				case SER_READ_VARIABLE: 
-					SER_AddData8(SER_GetData8(0));
-					switch(DB_GetType(SER_GetData8(0))) {
-						case U8: {
-							SER_AddData8(*((uint8_t*) DB_GetVar(SER_GetData8(0))));
-							break;
-						}
-						case U16: {
-							SER_AddData16(*((uint16_t*) DB_GetVar(SER_GetData8(0))));
-							break;
-						}
-						case MOT: {
-							MOT_PubData* t = (MOT_PubData*) DB_GetVar(SER_GetData8(0));
-							SER_AddData16(t->accel);
-							SER_AddData16(t->decel);
-							SER_AddData16(t->speed);
-							break;
-						}
-						case POS: {
-							BLOCK_Object* obj = (BLOCK_Object*) DB_GetVar(SER_GetData8(0));
-							SER_AddData16(obj->x);
-							SER_AddData16(obj->y);
-							SER_AddData16(obj->h);
-							break;
-						}
-						case T_DBGBUFFER: {
-							uint8_t i;
-							for(i=0; i<=SER_DEBUGBUFFER_LENGTH; i++) {
-								SER_AddData8(debugBuffer[i]);
-							}
-							break;
-						}
-					}
-					
-					SER_SendPacket(SER_WRITE_VARIABLE);
+		case SER_GET_POSITION:
+			SER_AddData16(port, rotary.position);
+			SER_AddData16(port, knee.position);
+			SER_AddData16(port, lift.position);
+			SER_SendPacket(port, SER_GET_POSITION);
+			break;
+
+		/** Configuration Commands **/
+		case SER_READ_VARIABLE: 
+			if(!DB_IsValid(SER_GetData8(port, 0))) {
+				SER_SendPacket(port, 'E');
+				break;
+			}
+			SER_AddData8(port, SER_GetData8(port, 0));
+			SER_AddDataN(port, buf, DB_Serialize(SER_GetData8(port, 0), buf));
+			SER_SendPacket(port, SER_WRITE_VARIABLE);
+			break;
+			
+		case SER_WRITE_VARIABLE: 
+			if(!DB_IsValid(SER_GetData8(port, 0))) {
+				SER_SendPacket(port, 'E');
+				break;
+			}
+			if(DB_GetType(SER_GetData8(port, 0)) == T_DBGBUFFER) {
+				// we're using this just do delete variable content...
+				SER_ResetDebugBuffer();
+				DB_SetDirty(DB_DBGBUFFER);
+				DB_SaveNVM();
+			}
+			else if(SER_GetDataLength(port) != 1 + DB_GetWireSize(SER_GetData8(port, 0))) {
+				SER_AddData8(port, SER_STATUS_INVALID);		// nothing applied
+			}
+			else {
+				EnterCritical();
+				DB_Deserialize(SER_GetData8(port, 0), &SER_GetData8(port, 1));
+				ExitCritical();
+				DB_NotifyChanges(DB_MASK(SER_GetData8(port, 0)));
+			}
+			SER_SendPacket(port, SER_WRITE_VARIABLE);            	
+			break;
+			
+		case SER_READ_VARIABLES:
+			/* answer is (id, value) for each requested id, as long as it fits into the packet */
+			for(i=0; i<SER_GetDataLength(port); i++) {
+				id = SER_GetData8(port, i);
+				if(!DB_IsValid(id) || SER_GetFreeSpace(port) < DB_GetWireSize(id)+1) {
 					break;
-					
-				case SER_WRITE_VARIABLE: 
-					switch(DB_GetType(SER_GetData8(0))) {
-						case U8: {
-							(*(uint8_t*) DB_GetVar(SER_GetData8(0))) = SER_GetData8(1);
-							break;
-						}
-						case U16: {
-							(*(uint16_t*) DB_GetVar(SER_GetData8(0))) = SER_GetData16(1);
-							break;
-						}
-						case MOT: {
-							((MOT_PubData*) DB_GetVar(SER_GetData8(0)))->accel = SER_GetData16(1);	
-							((MOT_PubData*) DB_GetVar(SER_GetData8(0)))->decel = SER_GetData16(3);
-							((MOT_PubData*) DB_GetVar(SER_GetData8(0)))->speed = SER_GetData16(5);
-                            MOT_RecalcValues(&rotary);
-                            MOT_RecalcValues(&knee);
-                            MOT_RecalcValues(&lift);
-							break;
-						}
-						case POS: {
-							((BLOCK_Object*) DB_GetVar(SER_GetData8(0)))->x = SER_GetData16(1);
-							((BLOCK_Object*) DB_GetVar(SER_GetData8(0)))->y = SER_GetData16(3);
-							((BLOCK_Object*) DB_GetVar(SER_GetData8(0)))->h = SER_GetData16(5);
-							break;
-						}
-						case T_DBGBUFFER: {
-							// we're using this just do delete variable content...
-							SER_ResetDebugBuffer();
-							DB_SaveNVM();
-							break;
-						}
-					}
+				}
+				SER_AddData8(port, id);
+				SER_AddDataN(port, buf, DB_Serialize(id, buf));
+			}
+			SER_SendPacket(port, SER_READ_VARIABLES);
+			break;
+			
+		case SER_WRITE_VARIABLES:
+			SER_AddData8(port, APP_WriteVariables(port));
+			SER_SendPacket(port, SER_WRITE_VARIABLES);
+			break;
+			
+		case SER_SAVE_NVM:
+			DB_SaveNVM();
+			SER_SendPacket(port, SER_SAVE_NVM);
+			APP_AddJob(port);
+			break;     	
+		
+		case SER_EVENT_STATUS:
+			for(i=0; i<EVNT_NOF_PRIOS; i++) {
+				SER_AddData16(port, EVNT_GetDropped((EVNT_Prio) i));
+			}
+			SER_AddData8(port, port->rx_dropped);
+			SER_SendPacket(port, SER_EVENT_STATUS);
+			break;
+			
+		case SER_TIMER_STATUS: {
+			uint16_t last, max, failed;
+			uint8_t used, max_used, idle;
+			TMR_GetTickTime(&last, &max);
+			TRG_GetPoolStats(&used, &max_used, &failed);
+			SER_AddData16(port, last);
+			SER_AddData16(port, max);
+			SER_AddData8(port, used);
+			SER_AddData8(port, max_used);
+			SER_AddData16(port, failed);
+			for(i=0; i<TRG_NOF_TRIGGERS; i++) {
+				SER_AddData16(port, TRG_GetOverruns(i));
+			}
+			TMR_GetIdleStats(&idle);
+			SER_GetRxLatency(&last, &max);	/* last byte of a request until it is handled */
+			SER_AddData8(port, idle);
+			SER_AddData16(port, last);
+			SER_AddData16(port, max);
+			SER_SendPacket(port, SER_TIMER_STATUS);
+			break;
+		}
+		
+		case SER_TASK_STATUS: {
+			SCHED_Stats stats[SCHED_NOF_TASKS];
+			SCHED_GetStats(stats);
+			for(i=0; i<SCHED_NOF_TASKS; i++) {
+				SER_AddData8(port, stats[i].cpu);
+				SER_AddData16(port, stats[i].max);
+				SER_AddData16(port, stats[i].overruns);
+				SER_AddData16(port, stats[i].late);
+			}
+			SER_SendPacket(port, SER_TASK_STATUS);
+			break;
+		}
+		
+		case SER_SCHEMA_HASH:
+			SER_AddData16(port, DB_GetSchemaHash());
+			SER_AddData8(port, DB_NOF_VARS);
+			SER_SendPacket(port, SER_SCHEMA_HASH);
+			break;
+			
+		case SER_SCHEMA_VARIABLE: {
+			/* answer is id, type, wire size, storage size, nvm flag and name */
+			const char* name;
+			id = SER_GetData8(port, 0);
+			if(!DB_IsValid(id)) {
+				SER_SendPacket(port, 'E');
+				break;
+			}
+			name = DB_GetName(id);
+			SER_AddData8(port, id);
+			SER_AddData8(port, DB_GetType(id));
+			SER_AddData8(port, DB_GetWireSize(id));
+			SER_AddData8(port, DB_GetSize(id));
+			SER_AddData8(port, DB_IsNVM(id));
+			SER_AddDataN(port, (const uint8_t*) name, strlen(name));
+			SER_SendPacket(port, SER_SCHEMA_VARIABLE);
+			break;
+		}
+		
+		case SER_NVM_STATUS: {
+			uint8_t sector;
+			uint16_t used;
+			DB_GetLogState(&sector, &used);
+			SER_AddData16(port, DB_GetDirty());
+			SER_AddData8(port, sector);
+			SER_AddData16(port, used);
+			SER_AddData8(port, DB_IsSaving());
+			SER_AddData16(port, (uint16_t) (DB_GetLoadTime() >> 16));
+			SER_AddData16(port, (uint16_t) DB_GetLoadTime());
+			SER_AddData16(port, (uint16_t) (boot_us >> 16));
+			SER_AddData16(port, (uint16_t) boot_us);
+			SER_AddData8(port, DB_LoadFailed());
+			SER_SendPacket(port, SER_NVM_STATUS);
+			break;
+		}
+		
+		case SER_DEBUG_PACKET: 
+			SER_AddData16(port, (uint16_t) MOT_GetState(&rotary));
+			SER_AddData16(port, (uint16_t) MOT_GetState(&knee));
+			SER_AddData16(port, (uint16_t) MOT_GetState(&lift));
+			SER_AddData16(port, rotary.position);
+			SER_AddData16(port, knee.position);
+			SER_AddData16(port, lift.position);
+			SER_AddData16(port, (uint16_t) BLOCK_GetSize());
+			SER_AddData16(port, (uint16_t) ROB_GetRunMode());
+			SER_AddData16(port, (uint16_t) BLOCK_GetState());
+			SER_AddData16(port, MOT_GetStartSkew());
+			SER_SendPacket(port, SER_DEBUG_PACKET);
+			break;
 	
-					SER_SendPacket(SER_WRITE_VARIABLE);            	
-					break;
-					
-				case SER_SAVE_NVM:
-					DB_SaveNVM();
-					SER_SendPacket(SER_SAVE_NVM);
-					break;     	
-				
-				case SER_DEBUG_PACKET: 
-					SER_AddData16((uint16_t) MOT_GetState(&rotary));
-					SER_AddData16((uint16_t) MOT_GetState(&knee));
-					SER_AddData16((uint16_t) MOT_GetState(&lift));
-					SER_AddData16(rotary.position);
-					SER_AddData16(knee.position);
-					SER_AddData16(lift.position);
-					SER_AddData16((uint16_t) BLOCK_GetSize());
-                    SER_AddData16((uint16_t) ROB_GetRunMode());
-                    SER_AddData16((uint16_t) BLOCK_GetState());
-					SER_SendPacket(SER_DEBUG_PACKET);
-					break;
-        	
-				/*********** OLD COMMANDS DOWN HERE ***********/
-                case '1':
-                    LED_RED_On();
-                    SER_SendPacket('1');
-                    break;
+		/*********** OLD COMMANDS DOWN HERE ***********/
+		case '1':
+			LED_RED_On();
+			SER_SendPacket(port, '1');
+			break;
 
-                case '2':
-                    LED_RED_Off();
-                    SER_SendPacket('2');
-                    break;
-                    
-                default:
-                	// send error message
-                	SER_SendPacket('E');
-                    break;
-        	}
-
-        	SER_SetHandled();
-        	break;
-        	
-        default:
-            break;
-    }
+		case '2':
+			LED_RED_Off();
+			SER_SendPacket(port, '2');
+			break;
+			
+		default:
+			// send error message
+			SER_SendPacket(port, 'E');
+			break;
+	}
 }
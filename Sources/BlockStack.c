@@ -15,6 +15,8 @@
 #include "Motors.h"
 #include "BlockStack.h"
 #include "Robot.h"
+#include "Timer.h"
+#include "Scheduler.h"
 #include "WAIT.h"
 
 static BLOCK_Object block_storage[BLOCK_STACK_MAX_SIZE];
@@ -47,6 +49,22 @@ uint8_t BLOCK_PickPlace_GetState(void) {
 	return (uint8_t) data.state;
 }
 
+static void BLOCK_DwellDone(void* unused) {
+	data.dwell = FALSE;
+	SCHED_Wake(SCHED_ROBOT);
+}
+
+/*! \brief Switches the valve and holds the FSM for BLOCK_VALVE_DWELL_US. */
+static void BLOCK_SwitchValve(bool state) {
+	HW_VALVE(state);
+	data.valve_switched = TRUE;
+	data.dwell = TRUE;
+	if(TMR_StartOneShot(BLOCK_VALVE_DWELL_US, BLOCK_DwellDone, NULL) == TMR_NO_ONESHOT) {
+		data.dwell = FALSE;		/* no timer free, don't stall the FSM */
+		SCHED_Wake(SCHED_ROBOT);
+	}
+}
+
 void BLOCK_MoveToBlockPos(BLOCK_Object xypos) {
 	ROB_MoveToXY(xypos.x, xypos.y);
 }
@@ -54,7 +72,10 @@ void BLOCK_MoveToBlockPos(BLOCK_Object xypos) {
 /*! \brief Pick and Place routine. 
  *
  * This function handles the FSM for pick and place logic. It will automatically collect 
- * all blocks that have been pushed to the block stack. 
+ * all blocks that have been pushed to the block stack. It runs in the robot task, 
+ * which is woken by the motion events of the step interrupts, so the checks below 
+ * are only evaluated when an axis has stopped, the lift passed the height watched 
+ * with MOT_WatchBelow() (BLOCK_CENTER), or the FSM moved on. 
  */
 void BLOCK_PickPlace_Process(void) {
 	BLOCK_Object block;
@@ -92,12 +113,17 @@ void BLOCK_PickPlace_Process(void) {
 			
 		case BLOCK_PICKED: 
 			/* wait for the lift to be lowered, switch vaccuum on and move to center */
-			if(!(ROB_Moving())) {					// wait for the last move to be finished
-				// vacuum on
-				HW_VALVE(TRUE);
+			if(!(ROB_Moving()) && !data.dwell) {	// wait for the last move and the valve to be finished
+				if(!data.valve_switched) {
+					// vacuum on
+					BLOCK_SwitchValve(TRUE);
+					break;
+				}
+				data.valve_switched = FALSE;
 
 				// Move up
 				ROB_MoveToZ(zTargetSurface - (data.nof_processed_blocks+3) * zBlockHeight);
+				MOT_WatchBelow(&lift, zTargetSurface - (data.nof_processed_blocks+2) * zBlockHeight);
 				data.state = BLOCK_CENTER;
 			}
 			break;
@@ -122,9 +148,13 @@ void BLOCK_PickPlace_Process(void) {
 			
 		case BLOCK_RELEASED:
 			/* wait for the lift to be lowered, switch vaccum off and move arm up */
-			if(!(ROB_Moving())) {					// wait for the last move to be finished
-				// vacuum off
-				HW_VALVE(FALSE);
+			if(!(ROB_Moving()) && !data.dwell) {	// wait for the last move and the valve to be finished
+				if(!data.valve_switched) {
+					// vacuum off
+					BLOCK_SwitchValve(FALSE);
+					break;
+				}
+				data.valve_switched = FALSE;
 				
 				// set Z target
 				//MOT_MoveSteps(&lift,   (int16_t) (25000-lift.position));
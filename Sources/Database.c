@@ -9,63 +9,175 @@
  * array. This allows to read and store data to the eeprom and 
  * makes it easy to change contents of the vars through the 
  * binary protocol.  
+ * 
+ * The table itself is generated at compile time from DB_VARS in 
+ * Database.h, together with the NVM image layout, the serializers and 
+ * the schema hash. 
+ * 
+ * NVM variables are stored in an append-only record log spread over 
+ * DB_LOG_NOF_SECTORS flash sectors. Each record holds the variable id, 
+ * its length, a CRC and the value. A save appends records, the sectors 
+ * are only erased when a compaction moves the log to the next sector. 
+ * The NVM component uses the plain write method, it only programs and 
+ * fails on bytes that are not erased, so an append never touches the 
+ * data already in the sector. The sectors are kept out of m_text 
+ * (ends at 0x1F000) in the CPU component memory areas. 
+ * A compaction writes an image of all variables into the next sector 
+ * (bank) and commits it with a CRC protected header written last. At 
+ * boot the newest valid bank is used, a broken one falls back to the 
+ * previous bank. 
  */
 
+#include <stddef.h>
+#include <string.h>
+#include "Cpu.h"
 #include "PE_Types.h"
 #include "Application.h"
 #include "Database.h"
+#include "Event.h"
 #include "Motors.h"
 #include "BlockStack.h"
 #include "Serial.h"
+#include "Robot.h"
+#include "Trigger.h"
+#include "Timer.h"
 #include "NVM.h"
 
-DB_Var database[DB_NOF_VARS];
+/* Serializers (big endian) of the data types */
+static void DB_Put_U8(uint8_t* buf, const void* var) {
+	buf[0] = *(const uint8_t*) var;
+}
+
+static void DB_Get_U8(const uint8_t* buf, void* var) {
+	*(uint8_t*) var = buf[0];
+}
+
+static void DB_Put_U16(uint8_t* buf, const void* var) {
+	DB_PUT16(buf, 0, *(const uint16_t*) var);
+}
+
+static void DB_Get_U16(const uint8_t* buf, void* var) {
+	*(uint16_t*) var = DB_GET16(buf, 0);
+}
+
+static void DB_Put_MOT(uint8_t* buf, const void* var) {
+	DB_PUT16(buf, 0, ((const MOT_PubData*) var)->accel);
+	DB_PUT16(buf, 2, ((const MOT_PubData*) var)->decel);
+	DB_PUT16(buf, 4, ((const MOT_PubData*) var)->speed);
+}
+
+static void DB_Get_MOT(const uint8_t* buf, void* var) {
+	((MOT_PubData*) var)->accel = DB_GET16(buf, 0);
+	((MOT_PubData*) var)->decel = DB_GET16(buf, 2);
+	((MOT_PubData*) var)->speed = DB_GET16(buf, 4);
+}
+
+static void DB_Put_POS(uint8_t* buf, const void* var) {
+	DB_PUT16(buf, 0, ((const BLOCK_Object*) var)->x);
+	DB_PUT16(buf, 2, ((const BLOCK_Object*) var)->y);
+	DB_PUT16(buf, 4, ((const BLOCK_Object*) var)->h);
+}
+
+static void DB_Get_POS(const uint8_t* buf, void* var) {
+	((BLOCK_Object*) var)->x = DB_GET16(buf, 0);
+	((BLOCK_Object*) var)->y = DB_GET16(buf, 2);
+	((BLOCK_Object*) var)->h = DB_GET16(buf, 4);
+}
+
+static void DB_Put_T_DBGBUFFER(uint8_t* buf, const void* var) {
+	memcpy(buf, var, DB_WIRE_T_DBGBUFFER);
+}
+
+static void DB_Get_T_DBGBUFFER(const uint8_t* buf, void* var) {
+	memcpy(var, buf, DB_WIRE_T_DBGBUFFER);
+}
+
+/* NVM image: all variables packed in id order, this gives the offsets */
+#define DB_X_IMAGE(name, id, var, type, nvm, hook)	uint8_t name[DB_SIZE_##type];
+typedef struct DB_NvmImage {
+	DB_VARS(DB_X_IMAGE)
+} DB_NvmImage;
+#define DB_LOG_IMAGE_SIZE	((sizeof(DB_NvmImage)+3) & ~3)	/* image size in a bank */
+
+#define DB_X_VAR(name, id, var, type, nvm, hook) \
+	[name] = { &(var), type, nvm, DB_SIZE_##type, DB_WIRE_##type, \
+			offsetof(DB_NvmImage, name), DB_Put_##type, DB_Get_##type, hook, #name },
+static const DB_Var database[DB_NOF_VARS] = {
+	DB_VARS(DB_X_VAR)
+};
+
+/* Schema description the hash is built from */
+#define DB_X_SCHEMA(name, id, var, type, nvm, hook)	#name "," #id "," #type "," #nvm ";"
+static const char schema[] = DB_VARS(DB_X_SCHEMA);
+static uint16_t schema_hash;
+
+/* local prototypes (static functions) */
+static uint16_t DB_Crc16(uint16_t crc, const uint8_t* data, uint16_t len);
+
+/* RAM buffer for the records of one save, longword aligned for flash programming */
+static uint32_t nvm_buffer[DB_NVM_SIZE/sizeof(uint32_t)];
+
+static uint8_t log_sector;		/* active log sector, DB_LOG_NO_SECTOR if none */
+static uint32_t log_seq;		/* sequence number of the active sector */
+static uint16_t log_pos;		/* offset of the first free byte in the active sector */
+static DB_VarMask dirty;		/* NVM variables changed since the last save */
+
+/* Background NVM job, advanced one flash operation at a time by DB_StepNVM() */
+typedef enum {
+	DB_JOB_IDLE,
+	DB_JOB_APPEND,		/* program the records at log_pos */
+	DB_JOB_ERASE,		/* erase the next sector */
+	DB_JOB_SNAPSHOT,	/* program the snapshot records */
+	DB_JOB_HEADER,		/* program the sector header except the magic */
+	DB_JOB_COMMIT,		/* program the magic, commits the new sector */
+	DB_JOB_DONE
+} DB_JobStep;
+
+static struct {
+	DB_JobStep step;
+	uint8_t sector;				/* sector written by the job */
+	uint16_t size;				/* bytes of records in nvm_buffer */
+	DB_VarMask saved;			/* dirty bits taken over, restored on failure */
+	DB_LogSectorHeader hdr;		/* header of a new sector */
+	bool failed;				/* last job ended with a flash error */
+	bool wait_motion;			/* next step waits for EVNT_MOT_IDLE */
+} job;
+static bool save_pending;		/* DB_SaveNVM() requested */
+static bool compact_pending;	/* DB_CompactNVM() requested */
+static uint32_t load_us;		/* duration of DB_LoadNVM() */
+static bool load_failed;		/* no valid bank and no old image, defaults in use */
+
+#define DB_NVM_RETRY_MS		5		/* wait before asking a busy flash controller again */
 
 void DB_Init(void) {
 	uint8_t i;
-	for(i=0; i<DB_NOF_VARS; i++) {		// set defaults for each varaible in database
-		database[i].var_ptr = NULL;		// empty pointer
-		database[i].nvm = FALSE;			// do not store to eeprom
-	}
 	
-	// Register Global Variables (all nvm variables must be registered here)
-	DB_RegisterVar(DB_DBGBUFFER, &debugBuffer, T_DBGBUFFER, TRUE);
-	DB_RegisterVar(DB_MOT_ROTARY, &(rotary.p), MOT, TRUE);
-	DB_RegisterVar(DB_MOT_KNEE, &(knee.p), MOT, TRUE);
-	DB_RegisterVar(DB_MOT_LIFT, &(lift.p), MOT, TRUE);
-	DB_RegisterVar(DB_BLOCK_ZBLOCKHEIGHT, &(zBlockHeight), U16, TRUE);
-	DB_RegisterVar(DB_BLOCK_ZTARGETSURFACE, &(zTargetSurface), U16, TRUE);
-	DB_RegisterVar(DB_BLOCK_ZGROUNDSURFACE, &(zGroundSurface), U16, TRUE);
-	DB_RegisterVar(DB_BLOCK_LIMPOS, &(lim_position), POS, TRUE);
-	DB_RegisterVar(DB_BLOCK_HOMEPOS, &(home_position), POS, TRUE);
-	DB_RegisterVar(DB_BLOCK_STACKPOS, &(stack_position), POS, TRUE);
+	// Hash over the schema and the type sizes of this build
+	schema_hash = DB_Crc16(0xFFFF, (const uint8_t*) schema, sizeof(schema)-1);
+	for(i=0; i<DB_NOF_VARS; i++) {
+		schema_hash = DB_Crc16(schema_hash, &database[i].size, 1);
+		schema_hash = DB_Crc16(schema_hash, &database[i].wire_size, 1);
+	}
 		
-	// Load values of registered globals from NVM
+	// Load values of the nvm variables
 	DB_LoadNVM();
 }
 
-void DB_RegisterVar(uint8_t varID, void* adr, DB_DataType type, bool eeprom) {
-	EnterCritical();
-	database[varID].var_ptr = adr;
-	database[varID].type = type;
-	database[varID].nvm = eeprom;
-	ExitCritical();
-}
-
 DB_DataType DB_GetType(uint8_t varID) {
 	return database[varID].type;
 }
 
-uint8_t DB_GetTypeSize(DB_DataType type) {
-	switch(type) {
-		case U8: 	return sizeof(uint8_t);
-		case U16:	return sizeof(uint16_t);
-		case MOT:	return sizeof(MOT_PubData);
-		case POS:	return sizeof(BLOCK_Object);
-		case T_DBGBUFFER: return SER_DEBUGBUFFER_LENGTH;
-	}
-	
-	return 0;
+const char* DB_GetName(uint8_t varID) {
+	return database[varID].name;
+}
+
+/*! \brief Returns the storage size (RAM and NVM) of a variable. */
+uint8_t DB_GetSize(uint8_t varID) {
+	return database[varID].size;
+}
+
+bool DB_IsNVM(uint8_t varID) {
+	return database[varID].nvm;
 }
 
 void* DB_GetVar(uint8_t varID) {
@@ -76,30 +188,617 @@ uint8_t DB_GetVar_u8(uint8_t varID) {
 	return *(uint8_t*) DB_GetVar(varID);
 }
 
-void DB_LoadNVM(void) {
-	uint8_t i, j;
-	uint32_t nvm_pos = (uint32_t) DB_NVM_BASE_ADDR;
+/*! \brief Checks if a variable id exists in the database.
+ *
+ *  \param varID  Variable id received from the host
+ *  \return TRUE if the variable exists
+ */
+bool DB_IsValid(uint8_t varID) {
+	return (varID < DB_NOF_VARS) && (database[varID].var_ptr != NULL);
+}
+
+/*! \brief Returns the number of bytes a variable uses in a serial packet.
+ *
+ *  \param varID  Variable id
+ *  \return Size in bytes (big endian encoded)
+ */
+uint8_t DB_GetWireSize(uint8_t varID) {
+	return database[varID].wire_size;
+}
+
+/*! \brief Encodes a variable for the serial protocol (big endian).
+ *
+ *  \param varID  Variable id
+ *  \param buf    Destination, must hold DB_GetWireSize() bytes
+ *  \return Number of bytes written
+ */
+uint8_t DB_Serialize(uint8_t varID, uint8_t* buf) {
+	database[varID].put(buf, database[varID].var_ptr);
+	return database[varID].wire_size;
+}
+
+/*! \brief Decodes a variable received by the serial protocol (big endian).
+ *
+ *  \param varID  Variable id
+ *  \param buf    Source, must hold DB_GetWireSize() bytes
+ *  \return Number of bytes read
+ */
+uint8_t DB_Deserialize(uint8_t varID, const uint8_t* buf) {
+	database[varID].get(buf, database[varID].var_ptr);
+	DB_SetDirty(varID);
+	return database[varID].wire_size;
+}
+
+/*! \brief Returns the hash of the database schema.
+ *
+ *  The hash covers names, ids, types, NVM flags and sizes of all 
+ *  variables. A host can compare it against the schema it was built for. 
+ */
+uint16_t DB_GetSchemaHash(void) {
+	return schema_hash;
+}
+
+/*! \brief Marks a variable as changed, it will be written by the next DB_SaveNVM().
+ *
+ *  Call this after changing a NVM variable through its pointer. 
+ *  \param varID  Variable id
+ */
+void DB_SetDirty(uint8_t varID) {
+	if(database[varID].nvm) {
+		EnterCritical();
+		dirty |= DB_MASK(varID);
+		ExitCritical();
+	}
+}
+
+/*! \brief Calls the change hooks of the written variables.
+ *
+ *  Call this once after a set of variables was written, outside of 
+ *  critical sections. Only the hooks of the written variables run. 
+ *  \param changed  Bit mask (DB_MASK(varID)) of the written variables
+ */
+void DB_NotifyChanges(DB_VarMask changed) {
+	uint8_t i;
 	for(i=0; i<DB_NOF_VARS; i++) {
-		if(database[i].nvm) {
-			for(j=0; j<DB_GetTypeSize(database[i].type); j++) {
-				NVM_GetByteFlash((NVM_TAddress)(nvm_pos+j), (uint8_t*) (database[i].var_ptr+j));
+		if((changed & DB_MASK(i)) && database[i].on_change != NULL) {
+			database[i].on_change(database[i].var_ptr);
+		}
+	}
+}
+
+/*! \brief Returns the NVM variables changed since the last save.
+ *
+ *  \return Bit mask (DB_MASK(varID)) of the unsaved variables
+ */
+DB_VarMask DB_GetDirty(void) {
+	return dirty;
+}
+
+/*! \brief Returns the active log sector and its fill level.
+ *
+ *  \param sector  Active sector, DB_LOG_NO_SECTOR if there is no log yet
+ *  \param used    Number of bytes used in the active sector
+ */
+void DB_GetLogState(uint8_t* sector, uint16_t* used) {
+	*sector = log_sector;
+	*used = log_pos;
+}
+
+/* Typed setters, these mark the variable for the next save and call its hook */
+void DB_SetU8(uint8_t varID, uint8_t value) {
+	*(uint8_t*) database[varID].var_ptr = value;
+	DB_SetDirty(varID);
+	DB_NotifyChanges(DB_MASK(varID));
+}
+
+void DB_SetU16(uint8_t varID, uint16_t value) {
+	*(uint16_t*) database[varID].var_ptr = value;
+	DB_SetDirty(varID);
+	DB_NotifyChanges(DB_MASK(varID));
+}
+
+void DB_SetMot(uint8_t varID, const MOT_PubData* value) {
+	*(MOT_PubData*) database[varID].var_ptr = *value;
+	DB_SetDirty(varID);
+	DB_NotifyChanges(DB_MASK(varID));
+}
+
+void DB_SetPos(uint8_t varID, const BLOCK_Object* value) {
+	*(BLOCK_Object*) database[varID].var_ptr = *value;
+	DB_SetDirty(varID);
+	DB_NotifyChanges(DB_MASK(varID));
+}
+
+/* CRC16 (CCITT, 0x1021) lookup table, one step per byte instead of per bit */
+static const uint16_t crc_table[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+	0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+	0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+	0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+	0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+	0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+	0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+	0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+	0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+	0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+	0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+	0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+	0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+	0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+	0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+	0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+	0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+	0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+	0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+	0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+	0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+	0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
+
+/*! \brief CRC16 (CCITT, 0x1021) used to protect the NVM records.
+ *
+ *  \param crc   Start value (0xFFFF) or CRC of the previous block
+ *  \param data  Data to add
+ *  \param len   Number of bytes
+ *  \return New CRC
+ */
+static uint16_t DB_Crc16(uint16_t crc, const uint8_t* data, uint16_t len) {
+	while(len--) {
+		crc = (crc << 8) ^ crc_table[(uint8_t) (crc >> 8) ^ *data++];
+	}
+	return crc;
+}
+
+/*! \brief Returns the flash address of a log sector. */
+static uint32_t DB_LogSectorAddr(uint8_t sector) {
+	return DB_LOG_BASE_ADDR + (uint32_t) sector * DB_LOG_SECTOR_SIZE;
+}
+
+/*! \brief Returns the CRC of a bank (sequence, schema, image size and image). */
+static uint16_t DB_BankCrc(const DB_LogSectorHeader* hdr, const uint8_t* image) {
+	return DB_Crc16(DB_Crc16(0xFFFF, (const uint8_t*) &(hdr->seq), 8), image, hdr->image_size);
+}
+
+/*! \brief Returns the CRC of a record (id, len and value). */
+static uint16_t DB_LogRecordCrc(const DB_LogRecord* rec) {
+	return DB_Crc16(DB_Crc16(0xFFFF, &(rec->id), 2), (const uint8_t*) (rec+1), rec->len);
+}
+
+/*! \brief Builds the log record of a variable.
+ *
+ *  \param varID  Variable id
+ *  \param buf    Destination, longword aligned
+ *  \return Size of the record in bytes (multiple of 4)
+ */
+static uint16_t DB_LogBuildRecord(uint8_t varID, uint8_t* buf) {
+	DB_LogRecord* rec = (DB_LogRecord*) buf;
+	uint8_t j;
+	uint16_t size;
+	
+	rec->id = varID;
+	rec->len = database[varID].size;
+	for(j=0; j<rec->len; j++) {
+		buf[sizeof(DB_LogRecord)+j] = *(uint8_t*) (database[varID].var_ptr+j);
+	}
+	size = DB_LOG_RECORD_SIZE(rec->len);
+	for(j=sizeof(DB_LogRecord)+rec->len; j<size; j++) {
+		buf[j] = 0xFF;						// padding stays erased
+	}
+	rec->crc = DB_LogRecordCrc(rec);
+	return size;
+}
+
+/*! \brief Index scan of a log sector.
+ *
+ *  Walks over the records of the sector and remembers the newest valid 
+ *  record of every variable. Records with a wrong CRC (interrupted write) 
+ *  or with a length not matching the current type are skipped. 
+ *  \param sector  Sector to scan
+ *  \param index   Flash address of the newest record per variable (0 = none)
+ *  \return Offset of the first free byte in the sector
+ */
+static uint16_t DB_LogScan(uint8_t sector, uint32_t* index) {
+	uint32_t base = DB_LogSectorAddr(sector);
+	uint16_t pos = sizeof(DB_LogSectorHeader) + ((const DB_LogSectorHeader*) base)->image_size;
+	const DB_LogRecord* rec;
+	
+	while(pos + sizeof(DB_LogRecord) <= DB_LOG_SECTOR_SIZE) {
+		rec = (const DB_LogRecord*) (base + pos);
+		if(*(const uint32_t*) rec == 0xFFFFFFFF) {
+			break;							// erased, end of log
+		}
+		if(pos + DB_LOG_RECORD_SIZE(rec->len) > DB_LOG_SECTOR_SIZE) {
+			pos = DB_LOG_SECTOR_SIZE;		// garbage, treat sector as full
+			break;
+		}
+		if(rec->id < DB_NOF_VARS && database[rec->id].nvm
+				&& rec->len == database[rec->id].size
+				&& rec->crc == DB_LogRecordCrc(rec)) {
+			index[rec->id] = (uint32_t) rec;
+		}
+		pos += DB_LOG_RECORD_SIZE(rec->len);
+	}
+	return pos;
+}
+
+/*! \brief Checks if the old fixed image at DB_NVM_BASE_ADDR can be there.
+ *
+ *  The image lies in the last log sector. It is only taken if the log 
+ *  was never used: all other log sectors are erased and the sector does 
+ *  not start with a bank header. 
+ */
+static bool DB_HasLegacyImage(void) {
+	const uint32_t* p;
+	
+	for(p = (const uint32_t*) DB_LOG_BASE_ADDR; p < (const uint32_t*) DB_NVM_BASE_ADDR; p++) {
+		if(*p != 0xFFFFFFFF) {
+			return FALSE;
+		}
+	}
+	return *(const uint32_t*) DB_NVM_BASE_ADDR != DB_LOG_MAGIC;
+}
+
+/*! \brief Copies the old fixed image at DB_NVM_BASE_ADDR into the variables.
+ *
+ *  Used only once after an update, when there is no log yet. The old 
+ *  image has the layout of DB_NvmImage up to DB_BLOCK_STACKPOS. 
+ */
+static void DB_LoadLegacyImage(void) {
+	uint8_t i;
+	for(i=0; i<=DB_BLOCK_STACKPOS; i++) {	// legacy layout ends with DB_BLOCK_STACKPOS
+		memcpy(database[i].var_ptr, (const void*) (DB_NVM_BASE_ADDR + database[i].offset), database[i].size);
+	}
+}
+
+/*! \brief Checks the header and the image CRC of a bank.
+ *
+ *  \param hdr  Sector header in flash
+ *  \return TRUE if the bank was committed completely
+ */
+static bool DB_BankIsValid(const DB_LogSectorHeader* hdr) {
+	return hdr->magic == DB_LOG_MAGIC && hdr->seq != 0xFFFFFFFF
+			&& hdr->image_size <= DB_LOG_SECTOR_SIZE - sizeof(DB_LogSectorHeader)
+			&& hdr->crc == DB_BankCrc(hdr, (const uint8_t*) (hdr+1));
+}
+
+/*! \brief Returns the bank with the highest sequence number, headers only.
+ *
+ *  \param rejected  Sectors to skip (bit per sector), their CRC check failed
+ *  \return Sector, DB_LOG_NO_SECTOR if there is none
+ */
+static uint8_t DB_NewestBank(uint8_t rejected) {
+	uint8_t i, best = DB_LOG_NO_SECTOR;
+	const DB_LogSectorHeader* hdr;
+	
+	for(i=0; i<DB_LOG_NOF_SECTORS; i++) {
+		hdr = (const DB_LogSectorHeader*) DB_LogSectorAddr(i);
+		if(!(rejected & (1<<i)) && hdr->magic == DB_LOG_MAGIC && hdr->seq != 0xFFFFFFFF
+				&& (best == DB_LOG_NO_SECTOR || hdr->seq > ((const DB_LogSectorHeader*) DB_LogSectorAddr(best))->seq)) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+/*! \brief Loads the NVM variables from the newest valid bank.
+ *
+ *  The bank with the highest sequence number is picked by its header and 
+ *  only this one is CRC checked. A bank with a broken image (power loss 
+ *  during a compaction) is skipped and the previous one is used. 
+ *  The variables are separate globals, so the image is copied with one 
+ *  memcpy per variable out of the memory mapped flash, then the records 
+ *  appended to the bank, every variable once from its newest record. 
+ *  The image is skipped if it was written with a different schema, the 
+ *  records still apply. 
+ */
+static void DB_LoadBank(void) {
+	uint8_t i, rejected = 0;
+	const DB_LogSectorHeader* hdr;
+	const uint8_t* image;
+	uint32_t index[DB_NOF_VARS];
+	
+	for(;;) {
+		log_sector = DB_NewestBank(rejected);
+		if(log_sector == DB_LOG_NO_SECTOR 
+				|| DB_BankIsValid((const DB_LogSectorHeader*) DB_LogSectorAddr(log_sector))) {
+			break;
+		}
+		rejected |= 1<<log_sector;
+	}
+	
+	if(log_sector == DB_LOG_NO_SECTOR) {
+		log_seq = 0;
+		if(DB_HasLegacyImage()) {
+			DB_LoadLegacyImage();
+		} else {
+			load_failed = TRUE;		// log data but no valid bank, keep the defaults
+		}
+		return;
+	}
+	
+	hdr = (const DB_LogSectorHeader*) DB_LogSectorAddr(log_sector);
+	log_seq = hdr->seq;
+	if(hdr->schema == schema_hash) {
+		image = (const uint8_t*) (hdr+1);
+		for(i=0; i<DB_NOF_VARS; i++) {
+			if(database[i].nvm) {
+				memcpy(database[i].var_ptr, image + database[i].offset, database[i].size);
 			}
+		}
+	}
+	
+	for(i=0; i<DB_NOF_VARS; i++) {
+		index[i] = 0;
+	}
+	log_pos = DB_LogScan(log_sector, index);
+	for(i=0; i<DB_NOF_VARS; i++) {
+		if(index[i] != 0) {
+			memcpy(database[i].var_ptr, (const void*) (index[i] + sizeof(DB_LogRecord)), 
+					((const DB_LogRecord*) index[i])->len);
+		}
+	}
+}
+
+/*! \brief Loads the NVM variables and measures the time it took. */
+void DB_LoadNVM(void) {
+	uint64_t start = TMR_GetMicros();
+	DB_LoadBank();
+	load_us = (uint32_t) (TMR_GetMicros() - start);
+}
+
+/*! \brief Returns the duration of the last DB_LoadNVM() in microseconds. */
+uint32_t DB_GetLoadTime(void) {
+	return load_us;
+}
 
-			nvm_pos += DB_GetTypeSize(database[i].type);
+/*! \brief Builds the records of the variables in mask into nvm_buffer.
+ *
+ *  \return Size of the records in bytes
+ */
+static uint16_t DB_BuildRecords(DB_VarMask mask) {
+	uint8_t i;
+	uint16_t size = 0;
+	for(i=0; i<DB_NOF_VARS; i++) {
+		if(mask & DB_MASK(i)) {
+			size += DB_LogBuildRecord(i, ((uint8_t*) nvm_buffer) + size);
 		}
 	}
+	return size;
 }
 
-void DB_SaveNVM(void) {
-	uint8_t i, j;
-	uint32_t nvm_pos = (uint32_t) DB_NVM_BASE_ADDR;
+/*! \brief Prepares a compaction job: image of all variables into the next bank.
+ *
+ *  The image is programmed first, then the bank header with the CRC and 
+ *  the magic word last, so an interrupted compaction leaves the old bank 
+ *  active: 
+ *  - erase: the sector holds the oldest bank, its header has a lower 
+ *    sequence number or fails the CRC check once it is half erased 
+ *  - image or header: the magic is still erased, the sector is ignored 
+ *  - magic: one longword program, the CRC rejects a broken bank 
+ *  Appends only program the erased end of the active bank. Going round 
+ *  robin through DB_LOG_NOF_SECTORS spreads the erase cycles over all 
+ *  sectors. 
+ */
+static void DB_StartCompaction(void) {
+	uint8_t i;
+	uint8_t* image = (uint8_t*) nvm_buffer;
+	
+	EnterCritical();
+	job.saved = dirty;
+	dirty = 0;							// image contains all current values
 	for(i=0; i<DB_NOF_VARS; i++) {
-		if(database[i].nvm) {
-			for(j=0; j<DB_GetTypeSize(database[i].type); j++) {
-				NVM_SetByteFlash((NVM_TAddress)(nvm_pos+j), *(uint8_t*) (database[i].var_ptr+j));
-			}
+		memcpy(image + database[i].offset, database[i].var_ptr, database[i].size);
+	}
+	ExitCritical();
+	for(i=sizeof(DB_NvmImage); i<DB_LOG_IMAGE_SIZE; i++) {
+		image[i] = 0xFF;				// padding stays erased
+	}
+	
+	job.sector = (log_sector == DB_LOG_NO_SECTOR) ? 0 : (log_sector+1) % DB_LOG_NOF_SECTORS;
+	job.size = DB_LOG_IMAGE_SIZE;
+	job.hdr.magic = DB_LOG_MAGIC;
+	job.hdr.seq = log_seq + 1;
+	job.hdr.schema = schema_hash;
+	job.hdr.image_size = DB_LOG_IMAGE_SIZE;
+	job.hdr.reserved = 0xFFFF;
+	job.hdr.crc = DB_BankCrc(&job.hdr, image);
+	job.step = DB_JOB_ERASE;
+	compact_pending = FALSE;
+	save_pending = FALSE;				// the snapshot covers a pending save too
+}
+
+/*! \brief Prepares an append job with the changed NVM variables.
+ *
+ *  \return FALSE if there is nothing to write
+ */
+static bool DB_StartAppend(void) {
+	EnterCritical();
+	job.saved = dirty;
+	dirty = 0;
+	ExitCritical();
+	save_pending = FALSE;
+	
+	if(log_sector == DB_LOG_NO_SECTOR) {
+		DB_StartCompaction();
+		return TRUE;
+	}
+	if(job.saved == 0) {
+		return FALSE;						// nothing changed
+	}
+	job.size = DB_BuildRecords(job.saved);
+	if(log_pos + job.size > DB_LOG_SECTOR_SIZE) {
+		DB_StartCompaction();				// snapshot contains the new values as well
+		return TRUE;
+	}
+	job.sector = log_sector;
+	job.step = DB_JOB_APPEND;
+	return TRUE;
+}
+
+/*! \brief Starts the next pending NVM job if the flash is idle. */
+static void DB_StartJob(void) {
+	if(job.step != DB_JOB_IDLE) {
+		return;								// picked up when the running job is done
+	}
+	if(compact_pending) {
+		DB_StartCompaction();
+	} else if(!save_pending) {
+		return;
+	} else if(!DB_StartAppend()) {
+		EVNT_SetEvent(EVNT_NVM_DONE);		// nothing changed, the save is complete
+		return;
+	}
+	EVNT_SetEvent(EVNT_NVM_STEP);
+}
+
+/*! \brief Schedules a compaction of the record log.
+ *
+ *  This is requested from the main loop (EVNT_NVM_COMPACT) long before the 
+ *  active sector is full. The work is done in the background by DB_StepNVM(). 
+ */
+void DB_CompactNVM(void) {
+	job.failed = FALSE;
+	compact_pending = TRUE;
+	DB_StartJob();
+}
 
-			nvm_pos += DB_GetTypeSize(database[i].type);
+/*! \brief Schedules an append of the changed NVM variables to the record log.
+ *
+ *  Only variables marked dirty are written. Their records are collected 
+ *  in a RAM buffer when the job starts and appended with one block write. 
+ *  Nothing is erased unless the active sector is full. The function returns 
+ *  at once, EVNT_NVM_DONE is set when the data is in flash. 
+ */
+void DB_SaveNVM(void) {
+	job.failed = FALSE;
+	save_pending = TRUE;
+	DB_StartJob();
+}
+
+static void DB_RetryStep(void* unused) {
+	EVNT_SetEvent(EVNT_NVM_STEP);
+}
+
+/*! \brief Issues the next flash operation of the running NVM job.
+ *
+ *  Called from the main loop on EVNT_NVM_STEP. Only one flash operation is 
+ *  started per call: a program operation is continued from NVM_OnWriteEnd 
+ *  (DB_OnWriteEnd()), an erase sets the next step event itself. 
+ *  The KL25Z has a single flash block without read-while-write, the core 
+ *  and with it the step interrupts of the motors stop while a flash 
+ *  operation runs. Operations are therefore only started while all axes 
+ *  stand still, DB_OnMotionIdle() continues a job held back by a move. 
+ */
+void DB_StepNVM(void) {
+	byte err;
+	bool wait_write;
+	DB_JobStep next;
+	uint32_t addr = DB_LogSectorAddr(job.sector);
+	
+	if(job.step != DB_JOB_IDLE && job.step != DB_JOB_DONE && ROB_Moving()) {
+		job.wait_motion = TRUE;
+		return;
+	}
+	
+	switch(job.step) {
+	case DB_JOB_APPEND:
+		err = NVM_SetBlockFlash((NVM_TDataAddress) nvm_buffer, (NVM_TAddress) (addr + log_pos), job.size);
+		next = DB_JOB_DONE;
+		wait_write = TRUE;
+		break;
+	case DB_JOB_ERASE:
+		err = NVM_EraseSector((NVM_TAddress) addr);
+		next = DB_JOB_SNAPSHOT;
+		wait_write = FALSE;
+		break;
+	case DB_JOB_SNAPSHOT:
+		err = NVM_SetBlockFlash((NVM_TDataAddress) nvm_buffer, (NVM_TAddress) (addr + sizeof(DB_LogSectorHeader)), job.size);
+		next = DB_JOB_HEADER;
+		wait_write = TRUE;
+		break;
+	case DB_JOB_HEADER:
+		err = NVM_SetBlockFlash((NVM_TDataAddress) &job.hdr.seq, (NVM_TAddress) (addr + offsetof(DB_LogSectorHeader, seq)), 
+				sizeof(DB_LogSectorHeader) - offsetof(DB_LogSectorHeader, seq));
+		next = DB_JOB_COMMIT;
+		wait_write = TRUE;
+		break;
+	case DB_JOB_COMMIT:
+		err = NVM_SetBlockFlash((NVM_TDataAddress) &job.hdr.magic, (NVM_TAddress) addr, sizeof(job.hdr.magic));
+		next = DB_JOB_DONE;
+		wait_write = TRUE;
+		break;
+	case DB_JOB_DONE:
+		if(job.sector == log_sector) {
+			log_pos += job.size;
+		} else {
+			log_sector = job.sector;
+			log_seq = job.hdr.seq;
+			log_pos = sizeof(DB_LogSectorHeader) + job.size;
+		}
+		if(log_pos >= DB_LOG_COMPACT_LEVEL) {
+			EVNT_SetEvent(EVNT_NVM_COMPACT);	// start a new sector while we have time
+		}
+		job.step = DB_JOB_IDLE;
+		EVNT_SetEvent(EVNT_NVM_DONE);
+		DB_StartJob();
+		return;
+	default:
+		return;
+	}
+	
+	if(err == ERR_BUSY) {
+		TRG_SetTrigger(TRG_NVM_RETRY, DB_NVM_RETRY_MS/TRG_TICKS_MS, DB_RetryStep, NULL);
+	} else if(err != ERR_OK) {
+		EnterCritical();
+		dirty |= job.saved;					// keep the values for the next save
+		ExitCritical();
+		job.step = DB_JOB_IDLE;
+		job.failed = TRUE;
+		EVNT_SetEvent(EVNT_NVM_DONE);
+	} else {
+		job.step = next;
+		if(!wait_write) {
+			EVNT_SetEvent(EVNT_NVM_STEP);
 		}
 	}
 }
+
+/*! \brief Called from NVM_OnWriteEnd when a program operation is finished. */
+void DB_OnWriteEnd(void) {
+	if(job.step != DB_JOB_IDLE) {
+		EVNT_SetEvent(EVNT_NVM_STEP);
+	}
+}
+
+/*! \brief Called on EVNT_MOT_IDLE, continues a job held back by a move. */
+void DB_OnMotionIdle(void) {
+	if(job.wait_motion) {
+		job.wait_motion = FALSE;
+		EVNT_SetEvent(EVNT_NVM_STEP);
+	}
+}
+
+/*! \brief Returns TRUE while an NVM job is running or pending. */
+bool DB_IsSaving(void) {
+	return job.step != DB_JOB_IDLE || save_pending || compact_pending;
+}
+
+/*! \brief Returns TRUE if no valid bank was found at boot and the defaults are used. */
+bool DB_LoadFailed(void) {
+	return load_failed;
+}
+
+/*! \brief Returns TRUE if the last NVM job failed. */
+bool DB_SaveFailed(void) {
+	return job.failed;
+}
@@ -12,56 +12,134 @@
 #include "Cpu.h"
 #include "Event.h"
 
-typedef uint8_t EVNT_MemUnit;
-#define EVNT_MEM_UNIT_NOF_BITS	(sizeof(EVNT_MemUnit)*8)
-static EVNT_MemUnit EVNT_Events[((EVNT_NOF_EVENTS-1)/EVNT_MEM_UNIT_NOF_BITS)+1];
+/* One byte per event: setting or clearing an event is a single byte store, 
+ * which is atomic on the Cortex-M0+, so no interrupt masking is needed. 
+ * (The BME decorated stores in bme.h only reach the peripheral space on 
+ * the KL25Z, not the SRAM.) The bytes are read as words for the lookup, 
+ * in little endian the lowest event of a word is in its lowest byte. */
+#define EVNT_NOF_WORDS	((EVNT_NOF_EVENTS+3)/4)
+static volatile union {
+	uint8_t flag[EVNT_NOF_WORDS*4];
+	uint32_t word[EVNT_NOF_WORDS];
+} EVNT_Events;
+
+/* Event queue: one ring buffer per priority. Any context may post (short 
+ * critical section), only the main loop takes entries out. */
+typedef struct EVNT_Entry {
+	EVNT_Handle event;
+	uint32_t payload;
+} EVNT_Entry;
+
+typedef struct EVNT_Queue {
+	EVNT_Entry entry[EVNT_QUEUE_LENGTH];
+	volatile uint8_t head;		/* next entry to write, free running */
+	volatile uint8_t tail;		/* next entry to read, free running */
+	uint16_t dropped;			/* entries lost because the ring was full */
+} EVNT_Queue;
+
+static EVNT_Queue EVNT_Queues[EVNT_NOF_PRIOS];
+
+/* de Bruijn sequence lookup: index of the lowest set bit of a word */
+static const uint8_t EVNT_DeBruijn[32] = {
+	0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+	31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+};
 
 void EVNT_Init(void) {
 	uint8_t i;
-
-	i = 0;
-	do {
-		EVNT_Events[i] = 0;
-		i++;
-	} while(i<sizeof(EVNT_Events)/sizeof(EVNT_Events[0]));
+	for(i=0; i<EVNT_NOF_WORDS; i++) {
+		EVNT_Events.word[i] = 0;
+	}
+	for(i=0; i<EVNT_NOF_PRIOS; i++) {
+		EVNT_Queues[i].head = 0;
+		EVNT_Queues[i].tail = 0;
+		EVNT_Queues[i].dropped = 0;
+	}
 }
 
 void EVNT_SetEvent(EVNT_Handle event) {
-	EnterCritical();
-	EVNT_Events[event/8] |= 0x80>>(event%8);
-	ExitCritical();
+	EVNT_Events.flag[event] = 1;
 }
 
 void EVNT_ClearEvent(EVNT_Handle event) {
-	EnterCritical();
-	EVNT_Events[event/8] &= ~(0x80>>(event%8));
-	ExitCritical();
+	EVNT_Events.flag[event] = 0;
 }
 
 bool EVNT_EventIsSet(EVNT_Handle event) {
-	bool result;
+	return EVNT_Events.flag[event] != 0;
+}
+
+void EVNT_HandleEvent(void (*callback)(EVNT_Handle)) {
+	/* Handle the one with the highest priority. Zero is the event with the highest priority. */
+	uint8_t i;
+	uint32_t w;
+	EVNT_Handle event;
+	
+	for(i=0; i<EVNT_NOF_WORDS; i++) {
+		w = EVNT_Events.word[i];
+		if(w != 0) {
+			event = (EVNT_Handle) (i*4 + EVNT_DeBruijn[(uint32_t) ((w & -w) * 0x077CB531U) >> 27] / 8);
+			/* Clear before the callback: if the event is set again in the meantime, 
+			 * the callback still sees the new state, or we catch it next time. */
+			EVNT_ClearEvent(event);
+			callback(event);
+			return;
+		}
+	}
+}
+
+bool EVNT_PostEvent(EVNT_Handle event, EVNT_Prio prio, uint32_t payload) {
+	EVNT_Queue* q = &EVNT_Queues[prio];
+	bool ok;
+	
 	EnterCritical();
-	result = EVNT_Events[event/8] & (0x80>>(event%8));
+	if((uint8_t) (q->head - q->tail) >= EVNT_QUEUE_LENGTH) {
+		q->dropped++;
+		ok = FALSE;
+	}
+	else {
+		q->entry[q->head % EVNT_QUEUE_LENGTH].event = event;
+		q->entry[q->head % EVNT_QUEUE_LENGTH].payload = payload;
+		q->head++;
+		ok = TRUE;
+	}
 	ExitCritical();
-	return result;
+	return ok;
 }
 
-void EVNT_HandleEvent(void (*callback)(EVNT_Handle)) {
-  /* Handle the one with the highest priority. Zero is the event with the highest priority. */
-   EVNT_Handle event;
+bool EVNT_HandleQueue(void (*callback)(EVNT_Handle, uint32_t)) {
+	uint8_t i;
+	EVNT_Queue* q;
+	EVNT_Entry e;
+	
+	for(i=0; i<EVNT_NOF_PRIOS; i++) {
+		q = &EVNT_Queues[i];
+		if(q->head != q->tail) {
+			e = q->entry[q->tail % EVNT_QUEUE_LENGTH];
+			q->tail++;				/* single consumer, the slot is free now */
+			callback(e.event, e.payload);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
 
-   EnterCritical();
-   for (event=(EVNT_Handle)0; event<EVNT_NOF_EVENTS; event++) { /* does a test on every event */
-     if (EVNT_EventIsSet(event)) { /* event present? */
-       EVNT_ClearEvent(event); /* clear event */
-       break; /* get out of loop */
-     }
-   }
-   ExitCritical();
-   if (event != EVNT_NOF_EVENTS) {
-     callback(event);
-     /* Note: if the callback sets the event, we will get out of the loop.
-      * We will catch it by the next iteration.
-      */
-   }
+uint16_t EVNT_GetDropped(EVNT_Prio prio) {
+	return EVNT_Queues[prio].dropped;
+}
+
+bool EVNT_IsIdle(void) {
+	uint8_t i;
+	
+	for(i=0; i<EVNT_NOF_WORDS; i++) {
+		if(EVNT_Events.word[i] != 0) {
+			return FALSE;
+		}
+	}
+	for(i=0; i<EVNT_NOF_PRIOS; i++) {
+		if(EVNT_Queues[i].head != EVNT_Queues[i].tail) {
+			return FALSE;
+		}
+	}
+	return TRUE;
 }
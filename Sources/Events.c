@@ -37,6 +37,7 @@ extern "C" {
 
 /* User includes (#include below this line is not maintained by Processor Expert) */
 #include "Event.h"
+#include "Database.h"
 #include "Serial.h"
 #include "Timer.h"
 #include "SIG.h"
@@ -100,7 +101,7 @@ void DBG_OnError(void)
 */
 void DBG_OnRxChar(void)
 {
-	SER_Process();
+	SER_Process(&SER_Dbg);
 }
 
 /*
@@ -160,8 +161,8 @@ void SYS_TICK_OnInterrupt(void)
 void SIG_OnChannel0(LDD_TUserData *UserDataPtr)
 {
 	if(rotary.running == TRUE) {
+		M1_STEP_NegVal();				// step first, axes started together step together
 		TPM0_C0V = TPM0_CNT + MOT_Process(&rotary);
-		M1_STEP_NegVal();
 		//LED_RED_Neg();
 	}
 }
@@ -188,8 +189,8 @@ void SIG_OnChannel0(LDD_TUserData *UserDataPtr)
 void SIG_OnChannel1(LDD_TUserData *UserDataPtr)
 {
 	if(knee.running == TRUE) {
-		TPM0_C1V = TPM0_CNT + MOT_Process(&knee);
 		M2_STEP_NegVal();
+		TPM0_C1V = TPM0_CNT + MOT_Process(&knee);
 		//LED_GREEN_Neg();
 	}
 }
@@ -216,11 +217,35 @@ void SIG_OnChannel1(LDD_TUserData *UserDataPtr)
 void SIG_OnChannel2(LDD_TUserData *UserDataPtr)
 {
 	if(lift.running == TRUE) {
-		TPM0_C2V = TPM0_CNT + MOT_Process(&lift);
 		M3_STEP_NegVal();
+		TPM0_C2V = TPM0_CNT + MOT_Process(&lift);
 	}
 }
 
+/*
+** ===================================================================
+**     Event       :  SIG_OnChannel3 (module Events)
+**
+**     Component   :  SIG [TimerUnit_LDD]
+*/
+/*!
+**     @brief
+**         Called if compare register match the counter registers or
+**         capture register has a new content. OnChannel3 event and
+**         Timer unit must be enabled. See [SetEventMask] and
+**         [GetEventMask] methods. This event is available only if a
+**         [Interrupt] is enabled.
+**     @param
+**         UserDataPtr     - Pointer to the user or
+**                           RTOS specific data. The pointer passed as
+**                           the parameter of Init method.
+*/
+/* ===================================================================*/
+void SIG_OnChannel3(LDD_TUserData *UserDataPtr)
+{
+	TMR_OnCompare();
+}
+
 /*
 ** ===================================================================
 **     Event       :  SIG_OnCounterRestart (module Events)
@@ -242,7 +267,7 @@ void SIG_OnChannel2(LDD_TUserData *UserDataPtr)
 /* ===================================================================*/
 void SIG_OnCounterRestart(LDD_TUserData *UserDataPtr)
 {
-  /* Write your code here ... */
+	TMR_OnCounterRestart();
 }
 
 /*
@@ -262,8 +287,9 @@ void SIG_OnCounterRestart(LDD_TUserData *UserDataPtr)
 */
 void Serial1_OnRxChar(void)
 {
-	SER_Process();
-  /* Write your code here ... */
+#ifdef SER_SERIAL1
+	SER_Process(&SER_Serial1);
+#endif
 }
 
 /*
@@ -281,7 +307,7 @@ void Serial1_OnRxChar(void)
 /* ===================================================================*/
 void NVM_OnWriteEnd(void)
 {
-  /* Write your code here ... */
+  DB_OnWriteEnd();
 }
 
 /* END Events */
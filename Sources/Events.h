@@ -15,6 +15,7 @@
 **         SIG_OnChannel0       - void SIG_OnChannel0(LDD_TUserData *UserDataPtr);
 **         SIG_OnChannel1       - void SIG_OnChannel1(LDD_TUserData *UserDataPtr);
 **         SIG_OnChannel2       - void SIG_OnChannel2(LDD_TUserData *UserDataPtr);
+**         SIG_OnChannel3       - void SIG_OnChannel3(LDD_TUserData *UserDataPtr);
 **         SYS_TICK_OnInterrupt - void SYS_TICK_OnInterrupt(void);
 **         DBG_OnError          - void DBG_OnError(void);
 **         DBG_OnRxChar         - void DBG_OnRxChar(void);
@@ -214,6 +215,27 @@ void SIG_OnChannel1(LDD_TUserData *UserDataPtr);
 /* ===================================================================*/
 void SIG_OnChannel2(LDD_TUserData *UserDataPtr);
 
+/*
+** ===================================================================
+**     Event       :  SIG_OnChannel3 (module Events)
+**
+**     Component   :  SIG [TimerUnit_LDD]
+*/
+/*!
+**     @brief
+**         Called if compare register match the counter registers or
+**         capture register has a new content. OnChannel3 event and
+**         Timer unit must be enabled. See [SetEventMask] and
+**         [GetEventMask] methods. This event is available only if a
+**         [Interrupt] is enabled.
+**     @param
+**         UserDataPtr     - Pointer to the user or
+**                           RTOS specific data. The pointer passed as
+**                           the parameter of Init method.
+*/
+/* ===================================================================*/
+void SIG_OnChannel3(LDD_TUserData *UserDataPtr);
+
 /*
 ** ===================================================================
 **     Event       :  SYS_TICK_OnInterrupt (module Events)
@@ -7,7 +7,9 @@
  * Part of this code is based on the atmel application note AVR446.
  */
 
+#include <stddef.h>
 #include "PE_Types.h"
+#include "Cpu.h"
 #include "Math.h"
 #include "Motors.h"
 #include "ILIM.h"
@@ -43,6 +45,7 @@
 #include "LED_RED.h"
 
 #include "Database.h"
+#include "Event.h"
 
 uint16_t OCR1A;		/* emulate atmel register */
 
@@ -51,14 +54,20 @@ MOT_FSMData knee;	/* Knickgelenk */
 MOT_FSMData lift;	/* Hebemechanismus */
 
 static LDD_TDeviceData *ILIM_Ptr;
+static uint16_t start_tick;		/* compare value all axes of the last MOT_Commit() started at */
+static uint8_t start_axes;		/* axes of the last MOT_Commit(), one bit per index */
 
 /* This will initialise the Motor module */
 void MOT_Init(void) {
 	// M1
 	rotary.index = ROTARY;
 	rotary.running = FALSE;
+	rotary.armed = FALSE;
+	rotary.done_pending = FALSE;
+	rotary.watching = FALSE;
 	rotary.invert = FALSE;
 	rotary.state = MOT_FSM_STOP;
+	rotary.position = 0;
 	MOT_SetStepMode(&rotary, MOT_STEP_32);
 	MOT_SetResetState(&rotary, TRUE);
 	MOT_CalcValues(&rotary, rotary.p.accel, rotary.p.decel, rotary.p.speed);
@@ -66,8 +75,12 @@ void MOT_Init(void) {
 	// M2
 	knee.index = KNEE;
 	knee.running = FALSE;
+	knee.armed = FALSE;
+	knee.done_pending = FALSE;
+	knee.watching = FALSE;
 	knee.invert = FALSE;
 	knee.state = MOT_FSM_STOP;
+	knee.position = 0;
 	MOT_SetStepMode(&knee, MOT_STEP_32);
 	MOT_SetResetState(&knee, TRUE);
 	MOT_CalcValues(&knee, knee.p.accel, knee.p.decel, knee.p.speed);
@@ -75,8 +88,12 @@ void MOT_Init(void) {
 	// M3
 	lift.index = LIFT;
 	lift.running = FALSE;
+	lift.armed = FALSE;
+	lift.done_pending = FALSE;
+	lift.watching = FALSE;
 	lift.invert = FALSE;
 	lift.state = MOT_FSM_STOP;
+	lift.position = 0;
 	MOT_SetStepMode(&lift, MOT_STEP_4);
 	MOT_SetResetState(&lift, TRUE);
 	MOT_CalcValues(&lift, lift.p.accel, lift.p.decel, lift.p.speed);
@@ -252,6 +269,38 @@ void MOT_RecalcValues(MOT_FSMData* m_) {
 	MOT_CalcValues(m_, m_->p.accel, m_->p.decel, m_->p.speed);
 }
 
+/*! \brief Database hook, called after the MOT_PubData of an axis was written.
+ *
+ * Only the axis the data belongs to is recalculated, its position is kept. 
+ * While the axis is running the recalculation is deferred until it stops 
+ * (MOT_OnAxisDone() on EVNT_MOT_<axis>_DONE), so a running profile is never 
+ * changed. MOT_PrepareSteps() also applies it if the event was not handled yet. 
+ *
+ * \param var  Pointer to the p member of the motor object
+ */
+void MOT_OnParamChange(void* var) {
+	MOT_FSMData* m_ = (MOT_FSMData*) ((uint8_t*) var - offsetof(MOT_FSMData, p));
+	
+	if(m_->running) {
+		m_->recalc_pending = TRUE;
+	}
+	else {
+		MOT_RecalcValues(m_);
+	}
+}
+
+/*! \brief Called from the main loop on EVNT_MOT_<axis>_DONE.
+ *
+ * Applies a recalculation MOT_OnParamChange() deferred while the axis ran. 
+ *
+ * \param m_	 Pointer to the motor object
+ */
+void MOT_OnAxisDone(MOT_FSMData* m_) {
+	if(!m_->running && m_->recalc_pending) {
+		MOT_RecalcValues(m_);
+	}
+}
+
 /*! \brief This will calculate the values for the motor to speed.
  *
  * \param m_	 Pointer to the motor object
@@ -263,7 +312,7 @@ void MOT_CalcValues(MOT_FSMData* m_, uint16_t accel, uint16_t decel, uint16_t sp
 	m_->p.accel = accel;
 	m_->p.decel = decel; 
 	m_->p.speed = speed;
-	m_->position = 0;
+	m_->recalc_pending = FALSE;
 	
 	// Set max speed limit, by calc min_delay to use in timer.
 	// min_delay = (alpha / tt)/ w
@@ -279,14 +328,37 @@ void MOT_CalcValues(MOT_FSMData* m_, uint16_t accel, uint16_t decel, uint16_t sp
 	}
 }
 
-/*! \brief This tells the motor to drive any number of steps.
+/*! \brief Returns TRUE if no axis runs or waits for MOT_Commit(). */
+static bool MOT_AllIdle(void) {
+	return !rotary.running && !knee.running && !lift.running
+			&& !rotary.armed && !knee.armed && !lift.armed
+			&& !rotary.done_pending && !knee.done_pending && !lift.done_pending;
+}
+
+/*! \brief Signals that an axis stopped, and if it was the last one, that all axes stand still. */
+static void MOT_SetDoneEvents(MOT_FSMData* m_) {
+	EVNT_SetEvent((EVNT_Handle) (EVNT_MOT_ROTARY_DONE + m_->index - ROTARY));
+	if(MOT_AllIdle()) {
+		EVNT_SetEvent(EVNT_MOT_IDLE);
+	}
+}
+
+/*! \brief Calculates the profile for a move of any number of steps.
+ *
+ * The axis does not start before MOT_Commit(), so several axes can be 
+ * prepared and then started on the same timer edge. 
  *
  * \param m_	 Pointer to the motor object
- * \param accel  Accelration to use, in 0.01*rad/sec^2.
- * \param decel  Decelration to use, in 0.01*rad/sec^2.
- * \param speed  Max speed, in 0.01*rad/sec.
+ * \param steps  Steps to move, the sign selects the direction.
  */
-void MOT_MoveSteps(MOT_FSMData* m_, int16_t steps) {
+void MOT_PrepareSteps(MOT_FSMData* m_, int16_t steps) {
+	m_->done_pending = FALSE;
+	
+	// Apply parameters written during the last move.
+	if(m_->recalc_pending) {
+		MOT_RecalcValues(m_);
+	}
+	
 	// Set direction from sign on step value.
 	if(steps < 0) {
 		if(!m_->invert)
@@ -307,8 +379,7 @@ void MOT_MoveSteps(MOT_FSMData* m_, int16_t steps) {
 		m_->accel_count = -1;
 		m_->state = MOT_FSM_DECEL;
 		m_->step_delay = 1000;
-		m_->running = TRUE;
-		OCR1A = 10;
+		m_->armed = TRUE;
 	}
 	else if(steps != 0) {		
 		// Find out after how many steps we must start deceleration.
@@ -353,15 +424,122 @@ void MOT_MoveSteps(MOT_FSMData* m_, int16_t steps) {
 		m_->step_count = 0;
 		m_->rest = 0;
 		m_->accel_count = 0;
-		m_->running = TRUE;
+		m_->armed = TRUE;
+	}
+	else if(!m_->running && !m_->armed) {
+		m_->done_pending = TRUE;	// nothing to do, a waiting FSM must still go on
+	}
+}
 
-		OCR1A = 10;
+/*! \brief Loads the compare channel of an axis with its first step. */
+static void MOT_SetStart(MOT_FSMData* m_, uint16_t tick) {
+	switch(m_->index) {
+		case ROTARY:
+			TPM0_C0SC |= TPM_CnSC_CHF_MASK;		// drop a match from the idle time
+			TPM0_C0V = tick;
+			break;
+		case KNEE:
+			TPM0_C1SC |= TPM_CnSC_CHF_MASK;
+			TPM0_C1V = tick;
+			break;
+		case LIFT:
+			TPM0_C2SC |= TPM_CnSC_CHF_MASK;
+			TPM0_C2V = tick;
+			break;
+	}
+}
+
+/*! \brief Starts all prepared axes together.
+ *
+ * All armed channels get the same compare value, MOT_START_DELAY ticks 
+ * after one TPM0_CNT snapshot, so their first steps are due on the same 
+ * timer edge. Axes prepared with zero steps are done here, EVNT_MOT_IDLE 
+ * is only set if no axis was started. 
+ */
+void MOT_Commit(void) {
+	MOT_FSMData* axes[3] = {&rotary, &knee, &lift};
+	uint8_t i, started = 0;
+	uint16_t tick;
+	
+	EnterCritical();
+	tick = TPM0_CNT + MOT_START_DELAY;
+	for(i = 0; i < 3; i++) {
+		if(axes[i]->armed) {
+			MOT_SetStart(axes[i], tick);
+			axes[i]->armed = FALSE;
+			axes[i]->first_step = TRUE;
+			axes[i]->running = TRUE;
+			started |= 1 << axes[i]->index;
+		}
+	}
+	for(i = 0; i < 3; i++) {
+		if(axes[i]->done_pending) {
+			axes[i]->done_pending = FALSE;
+			MOT_SetDoneEvents(axes[i]);
+		}
+	}
+	if(started != 0) {
+		start_tick = tick;
+		start_axes = started;
+	}
+	ExitCritical();
+}
+
+/*! \brief This tells the motor to drive any number of steps (prepare and commit one axis). */
+void MOT_MoveSteps(MOT_FSMData* m_, int16_t steps) {
+	MOT_PrepareSteps(m_, steps);
+	MOT_Commit();
+}
+
+/*! \brief Returns the spread of the first step times of the axes started by the last 
+ * MOT_Commit(), in SIG ticks, or MOT_NO_SKEW while some did not step yet. */
+uint16_t MOT_GetStartSkew(void) {
+	MOT_FSMData* axes[3] = {&rotary, &knee, &lift};
+	uint16_t min = 0xFFFF, max = 0;
+	uint8_t i;
+	
+	for(i = 0; i < 3; i++) {
+		if(start_axes & (1 << axes[i]->index)) {
+			if(axes[i]->first_step) {
+				return MOT_NO_SKEW;
+			}
+			if(axes[i]->start_latency < min) {
+				min = axes[i]->start_latency;
+			}
+			if(axes[i]->start_latency > max) {
+				max = axes[i]->start_latency;
+			}
+		}
+	}
+	return (start_axes == 0) ? MOT_NO_SKEW : max - min;
+}
+
+/*! \brief Sets EVNT_MOT_WATCH once, as soon as the axis position is below a value.
+ *
+ * This lets an FSM go on in the middle of a move without polling the position. 
+ * The event is set at once if the axis is already below. 
+ *
+ * \param m_		  Pointer to the motor object
+ * \param position  Position to watch
+ */
+void MOT_WatchBelow(MOT_FSMData* m_, uint16_t position) {
+	EnterCritical();
+	m_->watch_below = position;
+	m_->watching = (m_->position >= position);
+	ExitCritical();
+	if(!m_->watching) {
+		EVNT_SetEvent(EVNT_MOT_WATCH);
 	}
 }
 
 uint16_t MOT_Process(MOT_FSMData* m_) {
 	uint16_t new_step_delay = 0;
 
+	if(m_->first_step) {
+		m_->start_latency = TPM0_CNT - start_tick;
+		m_->first_step = FALSE;
+	}
+
 	OCR1A = m_->step_delay;
 	
 	if((m_->running) && (m_->state != MOT_FSM_STOP)) {
@@ -371,6 +549,10 @@ uint16_t MOT_Process(MOT_FSMData* m_) {
 		else {
 			m_->position--;
 		}
+		if(m_->watching && m_->position < m_->watch_below) {
+			m_->watching = FALSE;
+			EVNT_SetEvent(EVNT_MOT_WATCH);
+		}
 	}
 	
 	switch(m_->state) {	
@@ -378,6 +560,7 @@ uint16_t MOT_Process(MOT_FSMData* m_) {
 			m_->step_count = 0;
 			m_->rest = 0;
 			m_->running = FALSE;
+			MOT_SetDoneEvents(m_);
 			break;
 		
 		case MOT_FSM_ACCEL:
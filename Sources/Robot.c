@@ -13,6 +13,7 @@
 #include "Robot.h"
 #include "BlockStack.h"
 #include "Motors.h"
+#include "Scheduler.h"
 #include "WAIT.h"
 #include "VALVE.h"
 #include "LED_RED.h"
@@ -31,6 +32,7 @@ void ROB_Init(void) {
 
 void ROB_SetRunMode(ROB_RunMode mode) {
 	runmode = mode;
+	SCHED_Wake(SCHED_ROBOT);
 }
 
 uint8_t ROB_GetRunMode(void) {
@@ -49,14 +51,16 @@ uint16_t ROB_GetStateArray(void) {
 }
 
 void ROB_MoveToXY(uint16_t x, uint16_t y) {
-	MOT_MoveSteps(&rotary, (int16_t) (x-rotary.position));
-	MOT_MoveSteps(&knee,   (int16_t) (y-knee.position));
+	MOT_PrepareSteps(&rotary, (int16_t) (x-rotary.position));
+	MOT_PrepareSteps(&knee,   (int16_t) (y-knee.position));
+	MOT_Commit();
 }
 
 void ROB_MoveToXYZ(uint16_t x, uint16_t y, uint16_t z) {
-	MOT_MoveSteps(&rotary, (int16_t) (x-rotary.position));
-	MOT_MoveSteps(&knee,   (int16_t) (y-knee.position));
-	MOT_MoveSteps(&lift,   (int16_t) (z-lift.position));
+	MOT_PrepareSteps(&rotary, (int16_t) (x-rotary.position));
+	MOT_PrepareSteps(&knee,   (int16_t) (y-knee.position));
+	MOT_PrepareSteps(&lift,   (int16_t) (z-lift.position));
+	MOT_Commit();
 }
 
 void ROB_MoveToZ(uint16_t z) {
@@ -97,9 +101,19 @@ void HW_LED(uint8_t led, bool state) {
 
 void ROB_Start(void) {
 	running = TRUE;
+	SCHED_Wake(SCHED_ROBOT);
 }
 
+/*! \brief Robot task.
+ *
+ * Runs on demand: after a start, a motion event or a valve dwell. As long 
+ * as the run mode or the pick and place FSM move on, it wakes itself for 
+ * the next pass, otherwise it waits for the next wake-up. 
+ */
 void ROB_Process(void) {
+	ROB_RunMode mode = runmode;
+	uint8_t block_state = BLOCK_PickPlace_GetState();
+	
 	if(running) {
 		switch(runmode) {
 			case ROB_INIT:
@@ -154,9 +168,16 @@ void ROB_Process(void) {
 			default:
 				break;
 		}
+		if(runmode != mode || BLOCK_PickPlace_GetState() != block_state) {
+			SCHED_Wake(SCHED_ROBOT);
+		}
 	}
 }
 
+bool ROB_IsRunning(void) {
+	return running;
+}
+
 bool ROB_Moving(void) {
 	return (rotary.running | knee.running | lift.running);
 }
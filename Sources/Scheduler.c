@@ -0,0 +1,155 @@
+/**
+ * \file
+ * \brief Scheduler Module implementation.
+ * \author Christoph Bächler
+ *
+ * Cooperative scheduler for the main loop. Every task runs to completion. 
+ * Tasks with a period are released by a trigger in the tick interrupt, 
+ * so the tickless idle of the Timer module knows when to wake up. Tasks 
+ * without a period run on every pass, on demand tasks after SCHED_Wake(). 
+ * Each run is measured on the SIG timebase and checked against the 
+ * budget of the task. 
+ */
+
+#include "Cpu.h"
+#include "Scheduler.h"
+#include "Timer.h"
+#include "Trigger.h"
+#include <stddef.h>
+
+typedef struct SCHED_TaskDesc {
+	SCHED_Task fn;				/* NULL if not registered */
+	uint8_t prio;
+	uint16_t budget;			/* in SIG ticks */
+	bool gated;					/* runs only when ready (periodic or on demand) */
+	volatile bool ready;		/* released or woken, not run yet */
+	volatile bool released;		/* released by the trigger, not run yet */
+	uint32_t total;				/* SIG ticks spent since the last SCHED_GetStats() */
+	uint16_t max;				/* longest run since the last SCHED_GetStats() */
+	uint16_t overruns;
+	uint16_t late;
+} SCHED_TaskDesc;
+
+static SCHED_TaskDesc tasks[SCHED_NOF_TASKS];
+static uint8_t order[SCHED_NOF_TASKS];		/* registered tasks, sorted by priority */
+static uint8_t nof_tasks;
+static uint64_t window_start;				/* TMR_GetTicks() at the last SCHED_GetStats() */
+
+/* Trigger callback (tick interrupt): releases a periodic task */
+static void SCHED_Release(void* p) {
+	SCHED_TaskDesc* t = (SCHED_TaskDesc*) p;
+	
+	if(t->released) {
+		t->late++;				/* a period passed without running the task */
+	}
+	t->released = TRUE;
+	t->ready = TRUE;
+}
+
+uint8_t SCHED_AddTask(SCHED_TaskKind task, SCHED_Task fn, uint8_t prio, uint16_t period_ms, uint16_t budget_us) {
+	SCHED_TaskDesc* t;
+	TRG_Handle h;
+	uint8_t i;
+	
+	if(task >= SCHED_NOF_TASKS || fn == NULL || tasks[task].fn != NULL) {
+		return ERR_PARAM_INDEX;
+	}
+	t = &tasks[task];
+	if(period_ms != 0 && period_ms != SCHED_ON_DEMAND) {
+		h = TRG_Alloc();
+		if(h == TRG_NO_HANDLE) {
+			return ERR_NOTAVAIL;
+		}
+		TRG_SetMode(h, TRG_ISR);
+		TRG_SetPeriodic(h, period_ms/TRG_TICKS_MS, period_ms/TRG_TICKS_MS, SCHED_Release, t);
+	}
+	t->fn = fn;
+	t->prio = prio;
+	t->budget = TMR_US_TO_TICKS(budget_us);
+	t->gated = (period_ms != 0);
+	
+	/* insert behind all tasks with the same or a higher priority */
+	for(i = nof_tasks; i > 0 && tasks[order[i-1]].prio > prio; i--) {
+		order[i] = order[i-1];
+	}
+	order[i] = task;
+	nof_tasks++;
+	return ERR_OK;
+}
+
+void SCHED_Wake(SCHED_TaskKind task) {
+	tasks[task].ready = TRUE;
+}
+
+void SCHED_Run(void) {
+	uint8_t i;
+	uint16_t start, time;
+	SCHED_TaskDesc* t;
+	
+	for(i = 0; i < nof_tasks; i++) {
+		t = &tasks[order[i]];
+		if(t->gated) {
+			if(!t->ready) {
+				continue;
+			}
+			t->ready = FALSE;
+			t->released = FALSE;
+		}
+		start = TPM0_CNT;
+		t->fn();
+		time = TPM0_CNT - start;	/* runs longer than 174 ms are not measured correctly */
+		t->total += time;
+		if(time > t->max) {
+			t->max = time;
+		}
+		if(time > t->budget) {
+			t->overruns++;
+		}
+	}
+}
+
+void SCHED_Idle(void) {
+	uint8_t i;
+	
+	EnterCritical();
+	for(i = 0; i < nof_tasks; i++) {
+		if(tasks[order[i]].gated && tasks[order[i]].ready) {
+			ExitCritical();
+			return;
+		}
+	}
+	TMR_Idle();					/* checks events and triggers, sleeps with interrupts masked */
+	ExitCritical();
+}
+
+void SCHED_GetStats(SCHED_Stats stats[SCHED_NOF_TASKS]) {
+	uint8_t i;
+	uint64_t now = TMR_GetTicks();
+	uint64_t window = now - window_start;
+	
+	for(i = 0; i < SCHED_NOF_TASKS; i++) {
+		stats[i].cpu = (window == 0) ? 0 : (uint8_t) (((uint64_t) tasks[i].total*100) / window);
+		stats[i].max = tasks[i].max;
+		stats[i].overruns = tasks[i].overruns;
+		stats[i].late = tasks[i].late;
+		tasks[i].total = 0;
+		tasks[i].max = 0;
+	}
+	window_start = now;
+}
+
+void SCHED_Init(void) {
+	uint8_t i;
+	
+	for(i = 0; i < SCHED_NOF_TASKS; i++) {
+		tasks[i].fn = NULL;
+		tasks[i].ready = FALSE;
+		tasks[i].released = FALSE;
+		tasks[i].total = 0;
+		tasks[i].max = 0;
+		tasks[i].overruns = 0;
+		tasks[i].late = 0;
+	}
+	nof_tasks = 0;
+	window_start = TMR_GetTicks();
+}
@@ -8,31 +8,145 @@
  * concept documentation. Core of the module is the SER_Process() function 
  * which implements a finite state machine to read the packets char-by-char 
  * from the serial interface. 
+ * Every uart has its own protocol engine (SER_FSMData) with own packet 
+ * buffers, so requests and answers of different ports never get mixed. 
+ * Answers are always sent back on the port the request came from. 
+ * 
+ * Received packets are queued (SER_RX_QUEUE_LENGTH per port), so a host may 
+ * send further requests before the answer of the previous one arrived. 
+ * Requests framed with SER_START_SEQ/SER_END_SEQ carry a sequence id after 
+ * the command byte, which is echoed in the answer and in the SER_COMPLETE 
+ * message sent once a long running command has finished. 
  */
 
 #include "PE_Types.h"
 #include "Event.h"
 #include "Serial.h"
 #include "DBG.h"
+#ifdef SER_SERIAL1
+#include "Serial1.h"
+#endif
 #include "Robot.h"
+#include "Cpu.h"
+#include "Timer.h"
 
 //#define SER_DEBUG 
 
-static SER_FSMData data = {
-	SER_FSM_START,
-	{0,{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},0,0,0},	// input packet (request)
-	{0,{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},0,0,0},	// output packet (answer)
-	DBG_RecvChar,
-	DBG_SendChar
+#ifdef SER_RX_DMA
+/* DMA destination ring, must be aligned to its size for the DMOD circular mode */
+static uint8_t rxBuffer[SER_RX_BUFFER_SIZE] __attribute__((aligned(SER_RX_BUFFER_SIZE)));
+static uint16_t rxIndex;		/* next byte in rxBuffer to be parsed */
+static uint32_t rxPolled;		/* TMR_GetTicks() of the last look at the ring */
+#endif
+
+SER_FSMData SER_Dbg = {
+	.state = SER_FSM_START,
+	.ReceiveChar = DBG_RecvChar,
+	.SendChar = DBG_SendChar
 };
 
+#ifdef SER_SERIAL1
+SER_FSMData SER_Serial1 = {
+	.state = SER_FSM_START,
+	.ReceiveChar = Serial1_RecvChar,
+	.SendChar = Serial1_SendChar
+};
+#endif
+
+
 uint8_t debugBuffer[SER_DEBUGBUFFER_LENGTH+1];
 static uint8_t debugBuffer_cnt;
 
+static uint32_t rxArrival;		/* stamp for packets completed by the bytes being parsed */
+static uint16_t rxLatency;		/* SIG ticks from arrival until SER_SetHandled() */
+static uint16_t rxLatency_max;
+
+static void SER_ParseChar(SER_FSMData* port, uint8_t in);
+
 void SER_Init(void) {
 	debugBuffer_cnt = 0;
+#ifdef SER_RX_DMA
+	SER_RxDMAInit();
+#endif
+}
+
+#ifdef SER_RX_DMA
+/*! \brief Configures DMA channel 0 to copy every byte received on UART0 (DBG) 
+ *  into the rxBuffer ring. 
+ *
+ *  The per-byte receive interrupt of the DBG component is disabled, the 
+ *  ring is parsed in chunks by SER_RxPoll(). 
+ */
+void SER_RxDMAInit(void) {
+	rxIndex = 0;
+
+	SIM_SCGC6 |= SIM_SCGC6_DMAMUX_MASK;
+	SIM_SCGC7 |= SIM_SCGC7_DMA_MASK;
+	
+	DMAMUX0_CHCFG0 = 0;									// disable channel while configuring
+	DMA_DSR_BCR0 = DMA_DSR_BCR_DONE_MASK;				// clear pending state
+	DMA_SAR0 = (uint32_t) &UART0_D;
+	DMA_DAR0 = (uint32_t) rxBuffer;
+	DMA_DSR_BCR0 = DMA_DSR_BCR_BCR(SER_RX_DMA_BCR);
+	DMA_DCR0 = DMA_DCR_ERQ_MASK 						// peripheral request
+			 | DMA_DCR_CS_MASK							// one byte per request
+			 | DMA_DCR_SSIZE(1)							// 8 bit source
+			 | DMA_DCR_DINC_MASK						// increment destination...
+			 | DMA_DCR_DSIZE(1)							// 8 bit destination
+			 | DMA_DCR_DMOD(SER_RX_DMA_DMOD);			// ...wrapping inside rxBuffer
+	DMAMUX0_CHCFG0 = DMAMUX_CHCFG_ENBL_MASK | DMAMUX_CHCFG_SOURCE(SER_RX_DMA_SOURCE);
+	
+	UART0_C2 &= ~UART0_C2_RIE_MASK;						// no more DBG_OnRxChar() per byte
+	UART0_C5 |= UART0_C5_RDMAE_MASK;					// RDRF triggers DMA request instead
 }
 
+/*! \brief Parses all bytes the DMA has written to the ring up to now.
+ *
+ *  \param arrival  Earliest time the bytes may have arrived, stamped into 
+ *                  the completed packets for SER_GetRxLatency()
+ */
+static void SER_RxParse(uint32_t arrival) {
+	uint16_t write;
+	
+	rxArrival = arrival;
+	rxPolled = (uint32_t) TMR_GetTicks();
+	write = (uint16_t) ((DMA_DAR0 - (uint32_t) rxBuffer) & (SER_RX_BUFFER_SIZE-1));
+	while(rxIndex != write) {
+		SER_ParseChar(&SER_Dbg, rxBuffer[rxIndex]);
+		rxIndex = (rxIndex+1) & (SER_RX_BUFFER_SIZE-1);
+	}
+	
+	// re-arm byte counter long before it runs out
+	if((DMA_DSR_BCR0 & DMA_DSR_BCR_BCR_MASK) < SER_RX_BUFFER_SIZE) {
+		DMA_DCR0 &= ~DMA_DCR_ERQ_MASK;
+		DMA_DSR_BCR0 = DMA_DSR_BCR_DONE_MASK;
+		DMA_DSR_BCR0 = DMA_DSR_BCR_BCR(SER_RX_DMA_BCR);
+		DMA_DCR0 |= DMA_DCR_ERQ_MASK;
+	}
+}
+
+/*! \brief Parses all bytes the DMA has written to the ring since the last call.
+ *
+ *  This function is called from the periodic timer interrupt (1ms). At 
+ *  460800 baud about 46 bytes arrive per call, so the interrupt load 
+ *  depends on the number of ticks instead of the number of bytes. 
+ *  The bytes are stamped with the previous poll, the latency is an 
+ *  upper bound. 
+ */
+void SER_RxPoll(void) {
+	SER_RxParse(rxPolled);
+}
+
+/*! \brief Parses the ring after the UART has seen the line go idle.
+ *
+ *  Called by TMR_Idle() when the idle-line interrupt woke the core, so a 
+ *  request is answered without waiting for the (slowed down) tick. 
+ */
+void SER_RxIdleLine(void) {
+	SER_RxParse((uint32_t) TMR_GetTicks() - SER_RX_IDLE_TICKS);
+}
+#endif
+
 void SER_ResetDebugBuffer(void) {
 	uint8_t i;
 	for(i=0; i<=SER_DEBUGBUFFER_LENGTH; i++) {
@@ -43,113 +157,237 @@ void SER_ResetDebugBuffer(void) {
 
 /*! \brief Sends a single char to the uart.
  *
- *  \param ch  Char to send
+ *  \param port  Port to send on
+ *  \param ch    Char to send
  */
-void SER_SendChar(uint8_t ch) {
-	while(data.SendChar(ch)==ERR_TXFULL){}
+void SER_SendChar(SER_FSMData* port, uint8_t ch) {
+	while(port->SendChar(ch)==ERR_TXFULL){}
 }
  
-/*! \brief Sets the packet to handled state.
+/*! \brief Sets the packet to handled state and removes it from the queue.
+ *
+ *  \param port  Port of the packet
  */
-void SER_SetHandled(void) {
-	data.state = SER_FSM_START;
+void SER_SetHandled(SER_FSMData* port) {
+	uint32_t latency = (uint32_t) TMR_GetTicks() - port->input_packet[port->rx_head].arrival;
+	
+	EnterCritical();
+	rxLatency = (latency > 0xFFFF) ? 0xFFFF : (uint16_t) latency;
+	if(rxLatency > rxLatency_max) {
+		rxLatency_max = rxLatency;
+	}
+	ExitCritical();
+	port->rx_head = (port->rx_head+1) % SER_RX_QUEUE_LENGTH;
 	//HW_LED(BLUE, FALSE);
 }
 
+/*! \brief Returns the time from receiving a packet until it was handled.
+ *
+ *  \param last  Latency of the last packet, in SIG ticks
+ *  \param max   Largest latency since the last call, in SIG ticks
+ */
+void SER_GetRxLatency(uint16_t* last, uint16_t* max) {
+	EnterCritical();
+	*last = rxLatency;
+	*max = rxLatency_max;
+	rxLatency_max = 0;
+	ExitCritical();
+}
+
 /*! \brief Returns the length of the packet.
  *
+ *  \param port  Port of the packet
  *  \return Length of the packet
  */
-uint8_t* SER_GetLength(void) {
-	return &(data.input_packet.length);
+uint8_t* SER_GetLength(SER_FSMData* port) {
+	return &(port->input_packet[port->rx_head].length);
+}
+
+/*! \brief Returns the number of data bytes of the packet.
+ *
+ *  \param port  Port of the packet
+ *  \return Number of data bytes
+ */
+uint8_t SER_GetDataLength(SER_FSMData* port) {
+	return port->input_packet[port->rx_head].data_index;
+}
+
+/*! \brief Returns the sequence id of the packet.
+ *
+ *  \param port  Port of the packet
+ *  \return Sequence id, only valid if SER_IsSequenced() is TRUE
+ */
+uint8_t SER_GetSequence(SER_FSMData* port) {
+	return port->input_packet[port->rx_head].seq;
+}
+
+/*! \brief Returns if the packet was sent with a sequence id.
+ *
+ *  \param port  Port of the packet
+ *  \return TRUE = sequenced request, host expects SER_COMPLETE messages
+ */
+bool SER_IsSequenced(SER_FSMData* port) {
+	return port->input_packet[port->rx_head].sequenced;
 }
 
 /*! \brief Returns the command byte of the packet.
  *
+ *  \param port  Port of the packet
  *  \return Command byte of the packet
  */
-uint8_t* SER_GetCommand(void) {
-	return &(data.input_packet.command);
+uint8_t* SER_GetCommand(SER_FSMData* port) {
+	return &(port->input_packet[port->rx_head].command);
 }
 
 /*! \brief Returns the data bytes of the packet.
  *	Since this is a pointer to the first data byte in the packet 
- *  further bytes can be read by indexing: SER_GetData()[7]
+ *  further bytes can be read by indexing: SER_GetData(port)[7]
+ *  \param port  Port of the packet
  *  \return Data bytes of the packet
  */
-uint8_t* SER_GetData(void) {
-	return data.input_packet.data;
+uint8_t* SER_GetData(SER_FSMData* port) {
+	return port->input_packet[port->rx_head].data;
 }
 
 /*! \brief Returns if checksum is correct.
  *
+ *  \param port  Port of the packet
  *  \return TRUE = checksum ok
  */
-bool SER_TestChecksum(void) {
+bool SER_TestChecksum(SER_FSMData* port) {
 	// TODO: implement test of the checksum
 	return TRUE;
 }
 
 /*! \brief Adds a byte (uint8_t) to the packet.
  *
- *  \param d  Data byte to add
+ *  \param port  Port of the answer
+ *  \param d     Data byte to add
  */
-void SER_AddData8(uint8_t d) {
-	data.output_packet.data[data.output_packet.data_index] = d;
-	data.output_packet.data_index++;
+void SER_AddData8(SER_FSMData* port, uint8_t d) {
+	port->output_packet.data[port->output_packet.data_index] = d;
+	port->output_packet.data_index++;
 }
 
 /*! \brief Adds two bytes (uint16_t) to the packet.
  *
- *  \param d  Data bytes to add
+ *  \param port  Port of the answer
+ *  \param d     Data bytes to add
+ */
+void SER_AddData16(SER_FSMData* port, uint16_t d) {
+	port->output_packet.data[port->output_packet.data_index] = (uint8_t) (d >> 8);
+	port->output_packet.data_index++;
+	port->output_packet.data[port->output_packet.data_index] = (uint8_t) (d & 0xFF);
+	port->output_packet.data_index++;
+}
+
+/*! \brief Adds a number of bytes to the packet.
+ *
+ *  \param port  Port of the answer
+ *  \param d     Data bytes to add
+ *  \param n     Number of bytes
+ */
+void SER_AddDataN(SER_FSMData* port, const uint8_t* d, uint8_t n) {
+	uint8_t i;
+	for(i=0; i<n; i++) {
+		port->output_packet.data[port->output_packet.data_index] = d[i];
+		port->output_packet.data_index++;
+	}
+}
+
+/*! \brief Returns how many data bytes can still be added to the packet.
+ *
+ *  \param port  Port of the answer
+ *  \return Number of free bytes
  */
-void SER_AddData16(uint16_t d) {
-	data.output_packet.data[data.output_packet.data_index] = (uint8_t) (d >> 8);
-	data.output_packet.data_index++;
-	data.output_packet.data[data.output_packet.data_index] = (uint8_t) (d & 0xFF);
-	data.output_packet.data_index++;
+uint8_t SER_GetFreeSpace(SER_FSMData* port) {
+	return SER_DATA_LENGTH - port->output_packet.data_index;
 }
 
 /*! \brief Calculates and returns the checksum of the packet.
  *
+ *  \param port  Port of the answer
  *  \return Checksum of the packet
  */
-uint8_t SER_BuildChecksum(void) {
+uint8_t SER_BuildChecksum(SER_FSMData* port) {
 	// TODO: implement
 	return 0x00;
 }
 
-/*! \brief Sends a packet to the serial line.
+/*! \brief Sends the output packet to the serial line.
  *
- *  \param command  Command code of the packet
+ *  \param port       Port to send the packet on
+ *  \param command    Command code of the packet
+ *  \param sequenced  TRUE = frame with sequence id
+ *  \param seq        Sequence id
  */
-void SER_SendPacket(uint8_t command) {
+static void SER_SendFrame(SER_FSMData* port, uint8_t command, bool sequenced, uint8_t seq) {
 	uint8_t i;
-	data.output_packet.length = data.output_packet.data_index + 5;
-	data.output_packet.command = command;
-	data.output_packet.checksum = SER_BuildChecksum();
+	port->output_packet.length = port->output_packet.data_index + SER_FRAME_OVERHEAD + (sequenced ? 1 : 0);
+	port->output_packet.command = command;
+	port->output_packet.checksum = SER_BuildChecksum(port);
 
-	SER_SendChar(SER_START);
-	SER_SendChar(data.output_packet.length);
-	SER_SendChar(data.output_packet.command);
+	SER_SendChar(port, sequenced ? SER_START_SEQ : SER_START);
+	SER_SendChar(port, port->output_packet.length);
+	SER_SendChar(port, port->output_packet.command);
+	if(sequenced) {
+		SER_SendChar(port, seq);
+	}
 	
-	for(i=0; i<data.output_packet.data_index; i++) {
-		SER_SendChar(data.output_packet.data[i]);
+	for(i=0; i<port->output_packet.data_index; i++) {
+		SER_SendChar(port, port->output_packet.data[i]);
 	}
-	SER_SendChar(data.output_packet.checksum);
-	SER_SendChar(SER_END);
+	SER_SendChar(port, port->output_packet.checksum);
+	SER_SendChar(port, sequenced ? SER_END_SEQ : SER_END);
 	
-	data.output_packet.data_index = 0;
+	port->output_packet.data_index = 0;
 }
 
-/*! \brief FSM to receive packets.
+/*! \brief Sends a packet to the serial line.
+ *
+ *  The answer uses the same framing (and sequence id) as the request 
+ *  that is currently handled. 
+ *  \param port     Port to send the packet on
+ *  \param command  Command code of the packet
+ */
+void SER_SendPacket(SER_FSMData* port, uint8_t command) {
+	SER_SendFrame(port, command, SER_IsSequenced(port), SER_GetSequence(port));
+}
+
+/*! \brief Sends the asynchronous completion message of a sequenced request.
+ *
+ *  \param port     Port the request was received on
+ *  \param seq      Sequence id of the request
+ *  \param command  Command code of the request
+ *  \param status   SER_STATUS_OK or error code
+ */
+void SER_SendComplete(SER_FSMData* port, uint8_t seq, uint8_t command, uint8_t status) {
+	port->output_packet.data_index = 0;
+	SER_AddData8(port, command);
+	SER_AddData8(port, status);
+	SER_SendFrame(port, SER_COMPLETE, TRUE, seq);
+}
+
+/*! \brief Reads a single byte from the uart and passes it to the FSM.
  *
  *  This function is called from interrupt after a byte has arrived.
+ *  \param port  Port that received the byte
  */
-void SER_Process(void) {
+void SER_Process(SER_FSMData* port) {
 	uint8_t in = 0;
+	port->ReceiveChar(&in);
+	rxArrival = (uint32_t) TMR_GetTicks();
+	SER_ParseChar(port, in);
+}
+
+/*! \brief FSM to receive packets.
+ *
+ *  \param port  Port that received the byte
+ *  \param in    Received byte
+ */
+static void SER_ParseChar(SER_FSMData* port, uint8_t in) {
 	uint8_t* inp = &in;
-	data.ReceiveChar(inp);
+	SER_Packet* pkt;
 
 #ifdef SER_DEBUG
 	debugBuffer[debugBuffer_cnt] = in;
@@ -161,65 +399,85 @@ void SER_Process(void) {
 	}
 #endif
 	
-	switch(data.state) {
+	pkt = &(port->input_packet[port->rx_tail]);
+	
+	switch(port->state) {
 		case SER_FSM_START:
-			if(*inp == SER_START) {
+			if(*inp == SER_START || *inp == SER_START_SEQ) {
 				//HW_LED(GREEN, TRUE);
-				data.input_packet.data_index = 0;
-				data.output_packet.data_index = 0;
-				data.state = SER_FSM_LENGTH;
+				pkt->sequenced = (*inp == SER_START_SEQ);
+				pkt->seq = 0;
+				pkt->data_index = 0;
+				port->state = SER_FSM_LENGTH;
 			}
 			else {
-				data.state = SER_FSM_START;
+				port->state = SER_FSM_START;
 			}
 			break;
 
 		case SER_FSM_LENGTH:
-			data.input_packet.length = *inp;
-			data.state = SER_FSM_COMMAND;
+			pkt->length = *inp;
+			port->state = SER_FSM_COMMAND;
 			break;
 			
 		case SER_FSM_COMMAND:
-			data.input_packet.command = *inp;
-			if(data.input_packet.length > 5) {			// command with data
-				data.state = SER_FSM_DATA;
+			pkt->command = *inp;
+			if(pkt->sequenced) {
+				port->state = SER_FSM_SEQUENCE;
+			}
+			else if(pkt->length > SER_FRAME_OVERHEAD) {	// command with data
+				port->state = SER_FSM_DATA;
+			}
+			else {										// command without data
+				port->state = SER_FSM_CHECKSUM;
+			}
+			break;
+			
+		case SER_FSM_SEQUENCE:
+			pkt->seq = *inp;
+			if(pkt->length > SER_FRAME_OVERHEAD+1) {	// command with data
+				port->state = SER_FSM_DATA;
 			}
 			else {										// command without data
-				data.state = SER_FSM_CHECKSUM;
+				port->state = SER_FSM_CHECKSUM;
 			}
 			break;
 
 		case SER_FSM_DATA:
-			data.input_packet.data[data.input_packet.data_index] = *inp;
-			data.input_packet.data_index++;
-			if(data.input_packet.length <= (data.input_packet.data_index + 5)) {
-				data.state = SER_FSM_CHECKSUM;
+			if(pkt->data_index >= SER_DATA_LENGTH) {	// frame does not fit, drop it
+				port->state = SER_FSM_START;
+				break;
+			}
+			pkt->data[pkt->data_index] = *inp;
+			pkt->data_index++;
+			if(pkt->length <= (pkt->data_index + SER_FRAME_OVERHEAD + (pkt->sequenced ? 1 : 0))) {
+				port->state = SER_FSM_CHECKSUM;
 			}
 			break;
 
 		case SER_FSM_CHECKSUM:
-			data.input_packet.checksum = *inp;
-			data.state = SER_FSM_STOP;
+			pkt->checksum = *inp;
+			port->state = SER_FSM_STOP;
 			break;
 
 		case SER_FSM_STOP:
-			if(*inp == SER_END) {
-				EVNT_SetEvent(EVNT_SERIAL_CMD);
-				data.state = SER_FSM_BUSY;
+			if(*inp == (pkt->sequenced ? SER_END_SEQ : SER_END)) {
+				pkt->arrival = rxArrival;
+				if(((port->rx_tail+1) % SER_RX_QUEUE_LENGTH) != port->rx_head
+						&& EVNT_PostEvent(EVNT_SERIAL_CMD, EVNT_PRIO_HIGH, (uint32_t) port)) {
+					port->rx_tail = (port->rx_tail+1) % SER_RX_QUEUE_LENGTH;
+				}
+				else {									// queue full, host sent too many requests
+					port->rx_dropped++;
+				}
 				//HW_LED(GREEN, FALSE);
 				//HW_LED(BLUE, TRUE);
 			}
-			else {
-				data.state = SER_FSM_START;
-			}
-			break;
-
-		case SER_FSM_BUSY:
-			// while packet is not handled, fsm will stay in this state until packet is handled...
+			port->state = SER_FSM_START;
 			break;
 
 		default: 
-			data.state = SER_FSM_START;
+			port->state = SER_FSM_START;
 			break;
 	}
 }
@@ -5,15 +5,47 @@
  * \date 12.11.2013
  */
 
+#include "Cpu.h"
 #include "Timer.h"
 #include "Event.h"
 #include "Trigger.h"
+#include "Serial.h"
+
+static uint16_t tick_last;		/* duration of the last tick interrupt */
+static uint16_t tick_max;		/* longest tick interrupt since the last TMR_GetTickTime() */
+
+static volatile uint32_t sig_overflows;	/* upper bits of the SIG timebase */
+
+/* While sleeping, the tick runs 2^TMR_IDLE_SHIFT times slower instead of being 
+ * stopped, so it still wakes the core if nothing else does. */
+#ifdef SER_RX_DMA
+#define TMR_IDLE_SHIFT		2		/* 4 ms, the tick polls the receive ring which fills in 5.5 ms */
+#else
+#define TMR_IDLE_SHIFT		7		/* largest prescaler step of the TPM */
+#endif
+
+static uint64_t idle_us;		/* time slept in the current window */
+static uint64_t idle_start;		/* TMR_GetMicros() at the start of the window */
+static uint16_t idle_residual;	/* us of slowed ticks not yet passed to Trigger */
+static uint32_t tick_sc;		/* TPM1_SC of the normal 1 ms tick, taken in TMR_Init() */
+
+typedef struct TMR_OneShot {
+	uint16_t expiry;			/* TPM0_CNT value to fire at */
+	TMR_Callback cb;			/* NULL if the slot is free */
+	void* data;
+	uint8_t next;				/* next pending slot, sorted by expiry */
+} TMR_OneShot;
+
+static TMR_OneShot oneshots[TMR_NOF_ONESHOTS];
+static uint8_t oneshot_head = TMR_NO_ONESHOT;	/* earliest pending slot */
 
 /*! \brief Periodic timer interrupt.
  *
  *  This function is called from timer interrupt (1ms)
  */
 void TMR_OnInterrupt(void) {
+	uint16_t start = TPM0_CNT;
+	
 	/*
 	static uint16_t cnt = 0;	
 	cnt++;
@@ -23,4 +55,235 @@ void TMR_OnInterrupt(void) {
 	}*/
 
 	TRG_IncTick();
+	
+#ifdef SER_RX_DMA
+	SER_RxPoll();
+#endif
+
+	tick_last = TPM0_CNT - start;
+	if(tick_last > tick_max) {
+		tick_max = tick_last;
+	}
+}
+
+void TMR_GetTickTime(uint16_t* last, uint16_t* max) {
+	EnterCritical();
+	*last = tick_last;
+	*max = tick_max;
+	tick_max = 0;
+	ExitCritical();
+}
+
+void TMR_OnCounterRestart(void) {
+	sig_overflows++;
+}
+
+uint64_t TMR_GetTicks(void) {
+	uint32_t ovf;
+	uint16_t cnt;
+	
+	EnterCritical();
+	ovf = sig_overflows;
+	cnt = TPM0_CNT;
+	if(TPM0_SC & TPM_SC_TOF_MASK) {
+		/* overflow not serviced yet (we are in a critical section or a 
+		 * higher priority interrupt), re-read to be sure cnt is after it */
+		cnt = TPM0_CNT;
+		ovf++;
+	}
+	ExitCritical();
+	return ((uint64_t) ovf << 16) | cnt;
+}
+
+uint64_t TMR_GetMicros(void) {
+	return TMR_TICKS_TO_US(TMR_GetTicks());
+}
+
+/* Signed distance to the counter, valid as long as delays are < 0x8000 ticks */
+#define TMR_DUE(expiry)		((int16_t) ((expiry) - TPM0_CNT) <= 0)
+
+static void TMR_Unlink(uint8_t handle) {
+	uint8_t* p = &oneshot_head;
+	
+	while(*p != TMR_NO_ONESHOT) {
+		if(*p == handle) {
+			*p = oneshots[handle].next;
+			return;
+		}
+		p = &oneshots[*p].next;
+	}
+}
+
+/* Runs all expired timers and arms channel 3 for the next one. 
+ * Called with interrupts disabled or from the SIG interrupt. The channel 
+ * event is always enabled by the SIG driver (OnChannel3InitMask), which 
+ * also clears the flag: without a pending timer the stale compare value 
+ * matches once per counter wrap and the call finds nothing to do. */
+static void TMR_Dispatch(void) {
+	uint8_t h;
+	TMR_Callback cb;
+	
+	while(oneshot_head != TMR_NO_ONESHOT) {
+		h = oneshot_head;
+		if(!TMR_DUE(oneshots[h].expiry)) {
+			TPM0_C3V = oneshots[h].expiry;
+			if(!TMR_DUE(oneshots[h].expiry)) {
+				return;
+			}
+			continue;		/* counter passed the expiry while arming */
+		}
+		oneshot_head = oneshots[h].next;
+		cb = oneshots[h].cb;
+		oneshots[h].cb = NULL;
+		cb(oneshots[h].data);
+	}
+}
+
+uint8_t TMR_StartOneShot(uint32_t us, TMR_Callback cb, void* data) {
+	uint8_t h;
+	uint8_t* p;
+	uint16_t ticks;
+	
+	if(cb == NULL || us > TMR_ONESHOT_MAX_US) {
+		return TMR_NO_ONESHOT;
+	}
+	ticks = TMR_US_TO_TICKS(us);
+	
+	EnterCritical();
+	for(h = 0; h < TMR_NOF_ONESHOTS; h++) {
+		if(oneshots[h].cb == NULL) {
+			break;
+		}
+	}
+	if(h == TMR_NOF_ONESHOTS) {
+		ExitCritical();
+		return TMR_NO_ONESHOT;
+	}
+	oneshots[h].expiry = TPM0_CNT + ticks;
+	oneshots[h].cb = cb;
+	oneshots[h].data = data;
+	
+	p = &oneshot_head;
+	while(*p != TMR_NO_ONESHOT && (int16_t) (oneshots[*p].expiry - oneshots[h].expiry) <= 0) {
+		p = &oneshots[*p].next;
+	}
+	oneshots[h].next = *p;
+	*p = h;
+	
+	if(oneshot_head == h) {
+		TMR_Dispatch();
+	}
+	ExitCritical();
+	return h;
+}
+
+void TMR_CancelOneShot(uint8_t handle) {
+	if(handle >= TMR_NOF_ONESHOTS) {
+		return;
+	}
+	EnterCritical();
+	if(oneshots[handle].cb != NULL) {
+		TMR_Unlink(handle);
+		oneshots[handle].cb = NULL;
+	}
+	ExitCritical();
+}
+
+void TMR_OnCompare(void) {
+	TMR_Dispatch();
+}
+
+static void TMR_Wakeup(void* unused) {
+	/* nothing to do, the interrupt itself ends the WFI */
+}
+
+/*! \brief Restarts the tick counter (TPM1) with another prescaler.
+ *
+ *  PS is write protected until the TPM clock domain has acknowledged 
+ *  the stop, so CMOD is polled until it reads back 0. 
+ *  \param ps  Prescaler setting, (tick_sc & TPM_SC_PS_MASK) for the normal tick
+ */
+static void TMR_SetTickPrescaler(uint8_t ps) {
+	TPM1_SC = tick_sc & ~TPM_SC_CMOD_MASK;
+	while(TPM1_SC & TPM_SC_CMOD_MASK) {}
+	TPM1_SC = (tick_sc & ~(TPM_SC_CMOD_MASK|TPM_SC_PS_MASK)) | ps;
+	TPM1_SC = (tick_sc & ~TPM_SC_PS_MASK) | ps;
+}
+
+void TMR_Idle(void) {
+	uint8_t alarm = TMR_NO_ONESHOT;
+	uint32_t slept;
+	uint8_t ps, shift = 0;
+	uint64_t start;
+	TRG_TriggerTime next;
+	
+	EnterCritical();
+	if(!EVNT_IsIdle() || !TRG_IsIdle()) {
+		ExitCritical();				/* set after the main loop looked at it */
+		return;
+	}
+#ifdef SER_RX_DMA
+	if(UART0_S1 & UART0_S1_IDLE_MASK) {
+		UART0_S1 = UART0_S1_IDLE_MASK;	/* bytes came in since the last poll */
+		SER_RxIdleLine();
+		ExitCritical();
+		return;
+	}
+	UART0_C2 |= UART0_C2_ILIE_MASK;		/* end of a request wakes the core */
+#endif
+	start = TMR_GetMicros();
+	next = TRG_TicksToNext();
+	if(next > 1) {
+		ps = (uint8_t) (tick_sc & TPM_SC_PS_MASK);
+		shift = (TPM_SC_PS_MASK-ps < TMR_IDLE_SHIFT) ? TPM_SC_PS_MASK-ps : TMR_IDLE_SHIFT;
+		if(next-1 < (1u << shift)) {
+			/* the trigger is due before the slowed tick, wake up one tick early */
+			alarm = TMR_StartOneShot((uint32_t) (next-1)*TMR_TICK_MS*1000 - idle_residual, TMR_Wakeup, NULL);
+			if(alarm == TMR_NO_ONESHOT) {
+				shift = 0;					/* keep the normal tick */
+			}
+		}
+		if(shift > 0) {
+			TMR_SetTickPrescaler(ps+shift);
+		}
+	}
+	__asm volatile("wfi");			/* a pending interrupt wakes the core even if masked */
+	
+	slept = (uint32_t) (TMR_GetMicros() - start);
+	idle_us += slept;
+	if(shift > 0) {
+		TMR_SetTickPrescaler(ps);					/* normal tick again */
+		if(alarm != TMR_NO_ONESHOT) {
+			TMR_CancelOneShot(alarm);
+		}
+		/* the slowed counter covered 1/2^shift of the time, pass on the rest */
+		slept = slept - (slept >> shift) + idle_residual;
+		idle_residual = slept % (TMR_TICK_MS*1000);
+		TRG_AddTicks((TRG_TriggerTime) (slept / (TMR_TICK_MS*1000)));
+	}
+#ifdef SER_RX_DMA
+	UART0_C2 &= ~UART0_C2_ILIE_MASK;
+	if(UART0_S1 & UART0_S1_IDLE_MASK) {
+		UART0_S1 = UART0_S1_IDLE_MASK;
+		SER_RxIdleLine();						/* answer without waiting for the tick */
+	}
+#endif
+	ExitCritical();					/* the waking interrupt runs here */
+}
+
+void TMR_Init(void) {
+	tick_sc = TPM1_SC & ~TPM_SC_TOF_MASK;	/* as set up by the SYS_TICK component */
+	idle_start = TMR_GetMicros();
+}
+
+void TMR_GetIdleStats(uint8_t* percent) {
+	uint64_t now, window;
+	
+	EnterCritical();
+	now = TMR_GetMicros();
+	window = now - idle_start;
+	*percent = (window == 0) ? 0 : (uint8_t) ((idle_us*100) / window);
+	idle_us = 0;
+	idle_start = now;
+	ExitCritical();
 }
@@ -5,6 +5,9 @@
  * \date 12.11.2013
  *
  * This implementation is based on code from INTRO (Erich Styger).
+ * The triggers live in a fixed pool. The first TRG_NOF_TRIGGERS entries
+ * are reserved for the TRG_TriggerKind triggers, the rest is handed out
+ * by TRG_Alloc().
  */
 
 #include "Trigger.h"
@@ -13,70 +16,352 @@
 
  /*! \brief Descriptor for a trigger. */
 typedef struct TRG_TriggerDesc {
-  TRG_TriggerTime ticks;    /*!< tick count until trigger */
-  TRG_Callback callback;    /*!< callback function */
+  TRG_TriggerTime delta;    /*!< ticks after the previous trigger in the list */
+  TRG_Callback callback;    /*!< callback function, NULL if not active */
   TRG_CallBackDataPtr data; /*!< additional data pointer for callback */
+  uint8_t next;             /*!< next trigger in the list, TRG_NONE at the end */
+  TRG_Mode mode;            /*!< context of the callback */
+  TRG_TriggerTime period;   /*!< reload value of a periodic trigger, 0 for one-shot */
+  uint16_t overruns;        /*!< periods that fired before the last callback ran */
+  TRG_Callback due_callback;     /*!< deferred trigger that fired, run by TRG_Process() */
+  TRG_CallBackDataPtr due_data;
+  bool allocated;           /*!< pool entry in use */
+  bool autofree;            /*!< release the entry after the callback (TRG_StartOnce()) */
 } TRG_TriggerDesc;
 
-static TRG_TriggerDesc TRG_Triggers[TRG_NOF_TRIGGERS];  /*!< Array of triggers */
+#define TRG_NONE  0xFF      /*!< end of list */
 
-uint8_t TRG_SetTrigger(TRG_TriggerKind trigger, TRG_TriggerTime ticks, TRG_Callback callback, TRG_CallBackDataPtr data) {
+static TRG_TriggerDesc TRG_Triggers[TRG_POOL_SIZE];  /*!< Pool of triggers */
+static uint8_t TRG_Head;    /*!< active triggers, sorted by expiry (delta list) */
+static volatile uint32_t TRG_Due; /*!< deferred triggers that fired, one bit per trigger */
+static uint8_t TRG_Used;    /*!< allocated pool entries (without the reserved ones) */
+static uint8_t TRG_MaxUsed; /*!< high water mark of TRG_Used */
+static uint16_t TRG_AllocFailed; /*!< TRG_Alloc() calls that found the pool empty */
+
+/*!
+ * \brief Removes an active trigger from the delta list. Call with interrupts disabled.
+ * \param trigger Trigger to remove
+ */
+static void TRG_Unlink(uint8_t trigger) {
+  uint8_t i, prev = TRG_NONE;
+
+  for(i=TRG_Head; i!=TRG_NONE && i!=trigger; i=TRG_Triggers[i].next) {
+    prev = i;
+  }
+  if(i==TRG_NONE) {
+    return; /* not in list */
+  }
+  if(TRG_Triggers[i].next!=TRG_NONE) { /* successor keeps its expiry time */
+    TRG_Triggers[TRG_Triggers[i].next].delta += TRG_Triggers[i].delta;
+  }
+  if(prev==TRG_NONE) {
+    TRG_Head = TRG_Triggers[i].next;
+  } else {
+    TRG_Triggers[prev].next = TRG_Triggers[i].next;
+  }
+}
+
+/*!
+ * \brief Inserts a trigger into the delta list. Call with interrupts disabled.
+ * Triggers with the same expiry time fire in the order they were set.
+ * \param trigger Trigger to insert
+ * \param ticks Ticks from now
+ */
+static void TRG_Insert(uint8_t trigger, TRG_TriggerTime ticks) {
+  uint8_t i, prev = TRG_NONE;
+
+  for(i=TRG_Head; i!=TRG_NONE && ticks>=TRG_Triggers[i].delta; i=TRG_Triggers[i].next) {
+    ticks -= TRG_Triggers[i].delta;
+    prev = i;
+  }
+  TRG_Triggers[trigger].delta = ticks;
+  TRG_Triggers[trigger].next = i;
+  if(i!=TRG_NONE) {
+    TRG_Triggers[i].delta -= ticks;
+  }
+  if(prev==TRG_NONE) {
+    TRG_Head = trigger;
+  } else {
+    TRG_Triggers[prev].next = trigger;
+  }
+}
+
+/*!
+ * \brief Stops a trigger and drops a callback that is due but did not run yet.
+ * Call with interrupts disabled.
+ * \param trigger Trigger to stop
+ */
+static void TRG_Stop(uint8_t trigger) {
+  if(TRG_Triggers[trigger].callback != NULL) {
+    TRG_Unlink(trigger);
+    TRG_Triggers[trigger].callback = NULL;
+  }
+  TRG_Triggers[trigger].due_callback = NULL;
+  TRG_Due &= ~(1UL<<trigger);
+}
+
+/*!
+ * \brief Returns a pool entry. Call with interrupts disabled.
+ * \param trigger Trigger to release
+ */
+static void TRG_Release(uint8_t trigger) {
+  if(trigger>=TRG_NOF_TRIGGERS && TRG_Triggers[trigger].allocated) {
+    TRG_Triggers[trigger].allocated = FALSE;
+    TRG_Used--;
+  }
+}
+
+uint8_t TRG_SetTrigger(TRG_Handle trigger, TRG_TriggerTime ticks, TRG_Callback callback, TRG_CallBackDataPtr data) {
+  return TRG_SetPeriodic(trigger, ticks, 0, callback, data);
+}
+
+uint8_t TRG_SetPeriodic(TRG_Handle trigger, TRG_TriggerTime ticks, TRG_TriggerTime period,
+    TRG_Callback callback, TRG_CallBackDataPtr data) {
+  if(trigger>=TRG_POOL_SIZE || !TRG_Triggers[trigger].allocated) {
+    return ERR_PARAM_INDEX;
+  }
   EnterCritical();
-  TRG_Triggers[trigger].ticks = ticks;
+  if(TRG_Triggers[trigger].callback != NULL) {
+    TRG_Unlink(trigger); /* re-arm an active trigger */
+  }
+  TRG_Triggers[trigger].period = period;
   TRG_Triggers[trigger].callback = callback;
   TRG_Triggers[trigger].data = data;
+  if(callback != NULL) {
+    TRG_Insert(trigger, ticks);
+  }
   ExitCritical();
   return ERR_OK;
 }
 
+TRG_Handle TRG_Alloc(void) {
+  uint8_t i;
+
+  EnterCritical();
+  for(i=TRG_NOF_TRIGGERS; i<TRG_POOL_SIZE; i++) {
+    if(!TRG_Triggers[i].allocated) {
+      TRG_Triggers[i].allocated = TRUE;
+      TRG_Triggers[i].autofree = FALSE;
+      TRG_Triggers[i].mode = TRG_DEFERRED;
+      TRG_Triggers[i].overruns = 0;
+      TRG_Used++;
+      if(TRG_Used>TRG_MaxUsed) {
+        TRG_MaxUsed = TRG_Used;
+      }
+      ExitCritical();
+      return i;
+    }
+  }
+  TRG_AllocFailed++;
+  ExitCritical();
+  return TRG_NO_HANDLE;
+}
+
+void TRG_Free(TRG_Handle trigger) {
+  if(trigger>=TRG_POOL_SIZE) {
+    return;
+  }
+  EnterCritical();
+  TRG_Stop(trigger);
+  TRG_Release(trigger);
+  ExitCritical();
+}
+
+TRG_Handle TRG_StartOnce(TRG_TriggerTime ticks, TRG_Callback callback, TRG_CallBackDataPtr data) {
+  TRG_Handle h = TRG_Alloc();
+
+  if(h!=TRG_NO_HANDLE) {
+    TRG_Triggers[h].autofree = TRUE;
+    TRG_SetTrigger(h, ticks, callback, data);
+  }
+  return h;
+}
+
+void TRG_Cancel(TRG_Handle trigger) {
+  if(trigger>=TRG_POOL_SIZE) {
+    return;
+  }
+  EnterCritical();
+  TRG_Stop(trigger);
+  if(TRG_Triggers[trigger].autofree) {
+    TRG_Release(trigger);
+  }
+  ExitCritical();
+}
+
+uint8_t TRG_Reschedule(TRG_Handle trigger, TRG_TriggerTime ticks) {
+  uint8_t res = ERR_OK;
+
+  if(trigger>=TRG_POOL_SIZE) {
+    return ERR_PARAM_INDEX;
+  }
+  EnterCritical();
+  if(TRG_Triggers[trigger].callback == NULL) {
+    res = ERR_NOTAVAIL; /* not active (fired or cancelled) */
+  } else {
+    TRG_Unlink(trigger);
+    TRG_Insert(trigger, ticks);
+  }
+  ExitCritical();
+  return res;
+}
+
+void TRG_GetPoolStats(uint8_t* used, uint8_t* max_used, uint16_t* failed) {
+  EnterCritical();
+  *used = TRG_Used;
+  *max_used = TRG_MaxUsed;
+  *failed = TRG_AllocFailed;
+  ExitCritical();
+}
+
 void TRG_Init(void) {
-  TRG_TriggerKind i;
+  uint8_t i;
 
-  for(i=(TRG_TriggerKind)0;i<TRG_NOF_TRIGGERS;i++) {
-    TRG_Triggers[i].ticks = 0;
+  for(i=0;i<TRG_POOL_SIZE;i++) {
+    TRG_Triggers[i].delta = 0;
     TRG_Triggers[i].callback = NULL;
     TRG_Triggers[i].data = NULL;
+    TRG_Triggers[i].next = TRG_NONE;
+    TRG_Triggers[i].mode = TRG_DEFERRED;
+    TRG_Triggers[i].period = 0;
+    TRG_Triggers[i].overruns = 0;
+    TRG_Triggers[i].due_callback = NULL;
+    TRG_Triggers[i].due_data = NULL;
+    TRG_Triggers[i].allocated = (i<TRG_NOF_TRIGGERS); /* reserved for TRG_TriggerKind */
+    TRG_Triggers[i].autofree = FALSE;
   }
+  TRG_Head = TRG_NONE;
+  TRG_Due = 0;
+  TRG_Used = 0;
+  TRG_MaxUsed = 0;
+  TRG_AllocFailed = 0;
+}
+
+void TRG_SetMode(TRG_Handle trigger, TRG_Mode mode) {
+  TRG_Triggers[trigger].mode = mode;
 }
 
 /*!
- * \brief Goes through the list of triggers and returns TRUE in case we have to call a callback.
- * \return Returns TRUE if we have called a callback.
+ * \brief Counts down the first trigger of the delta list and fires all triggers that are due.
+ * Only the head of the list is touched, so a tick without expiry costs the same for any
+ * number of active triggers. Triggers set with 0 ticks since the last tick are at the head
+ * with a delta of 0, they are passed over and the tick is counted on the first trigger
+ * behind them, so the rest of the list does not lose it. A callback may set a trigger at
+ * the current time, it is fired in the same tick. Deferred triggers are only marked due
+ * here, TRG_Process() calls them.
+ * A periodic trigger is put back into the list right here, relative to the tick it was due,
+ * so its phase never depends on when the callback runs.
  */
-static bool CheckCallbacks(void) {
-  TRG_TriggerKind i;
+void TRG_IncTick(void) {
+  uint8_t i;
   TRG_Callback callback;
   TRG_CallBackDataPtr data;
-  bool calledCallBack = FALSE;
 
-  for(i=(TRG_TriggerKind)0; i<TRG_NOF_TRIGGERS; i++) {
+  EnterCritical();
+  for(i=TRG_Head; i!=TRG_NONE && TRG_Triggers[i].delta==0; i=TRG_Triggers[i].next) {
+    /* already due, fired below */
+  }
+  if(i!=TRG_NONE) {
+    TRG_Triggers[i].delta--; /* counts the tick for this and all later triggers */
+  }
+  while(TRG_Head!=TRG_NONE && TRG_Triggers[TRG_Head].delta==0) { /* trigger! */
+    i = TRG_Head;
+    TRG_Head = TRG_Triggers[i].next;
+    callback = TRG_Triggers[i].callback; /* get a copy */
+    data = TRG_Triggers[i].data; /* get backup of data, as callback might setup this trigger again */
+    if(TRG_Triggers[i].period!=0) {
+      TRG_Insert(i, TRG_Triggers[i].period); /* next period, stays active */
+    } else {
+      TRG_Triggers[i].callback = NULL; /* not active anymore */
+    }
+    if(TRG_Triggers[i].mode==TRG_DEFERRED) {
+      if(TRG_Due & (1UL<<i)) {
+        TRG_Triggers[i].overruns++; /* last callback did not run yet */
+      }
+      TRG_Triggers[i].due_callback = callback;
+      TRG_Triggers[i].due_data = data;
+      TRG_Due |= 1UL<<i;
+      continue;
+    }
+    ExitCritical();
+    callback(data);
     EnterCritical();
-    if(TRG_Triggers[i].ticks==0 && TRG_Triggers[i].callback != NULL) { /* trigger! */
-      callback = TRG_Triggers[i].callback; /* get a copy */
-      data = TRG_Triggers[i].data; /* get backup of data, as we overwrite it below */
-      /* reset trigger structure, as callback might setup this trigger again */
-      TRG_Triggers[i].callback = NULL; /* NULL callback prevents that we are called again */
-      ExitCritical();
-      callback(data);
-      calledCallBack = TRUE; /* callback may have set a trigger at the current time: rescan trigger list */
-    } 
-    else {
-      ExitCritical();
+    if(TRG_Triggers[i].autofree && TRG_Triggers[i].callback==NULL) {
+      TRG_Release(i); /* one-shot from TRG_StartOnce() is done */
     }
-  } /* for */
-  return calledCallBack;
+  }
+  ExitCritical();
 }
 
-void TRG_IncTick(void) {
-  TRG_TriggerKind i;
+TRG_TriggerTime TRG_TicksToNext(void) {
+  TRG_TriggerTime ticks;
 
   EnterCritical();
-  for(i=(TRG_TriggerKind)0;i<TRG_NOF_TRIGGERS;i++) {
-    if (TRG_Triggers[i].ticks!=0) { /* prevent underflow */
-      TRG_Triggers[i].ticks--;
+  ticks = (TRG_Head==TRG_NONE) ? TRG_NO_EXPIRY : TRG_Triggers[TRG_Head].delta;
+  ExitCritical();
+  return ticks;
+}
+
+void TRG_AddTicks(TRG_TriggerTime ticks) {
+  TRG_TriggerTime skip;
+
+  while(ticks>0) {
+    EnterCritical();
+    if(TRG_Head==TRG_NONE) {
+      ExitCritical();
+      return; /* nothing to count down */
     }
-  } /* for */
+    skip = TRG_Triggers[TRG_Head].delta; /* ticks that only count down the head */
+    if(skip>0) {
+      skip--;
+    } /* else: the head is already due, TRG_IncTick() fires it and counts the tick on the rest */
+    if(skip>=ticks) {
+      skip = ticks-1;
+    }
+    TRG_Triggers[TRG_Head].delta -= skip;
+    ExitCritical();
+    ticks -= skip;
+    TRG_IncTick(); /* the tick with the expiry */
+    ticks--;
+  }
+}
+
+bool TRG_IsIdle(void) {
+  return TRG_Due==0;
+}
+
+void TRG_Process(void) {
+  uint8_t i;
+  uint32_t due;
+  TRG_Callback callback;
+  TRG_CallBackDataPtr data;
+
+  if(TRG_Due==0) {
+    return;
+  }
+  EnterCritical();
+  due = TRG_Due;
+  TRG_Due = 0;
   ExitCritical();
-  while(CheckCallbacks()) {} /* while we have callbacks, re-iterate the list as this may have added new triggers at the current time */
+  for(i=0; i<TRG_POOL_SIZE; i++) {
+    if(due & (1UL<<i)) {
+      EnterCritical();
+      callback = TRG_Triggers[i].due_callback; /* NULL if cancelled in the meantime */
+      data = TRG_Triggers[i].due_data;
+      TRG_Triggers[i].due_callback = NULL;
+      ExitCritical();
+      if(callback != NULL) {
+        callback(data);
+        EnterCritical();
+        if(TRG_Triggers[i].autofree && TRG_Triggers[i].callback==NULL && TRG_Triggers[i].due_callback==NULL) {
+          TRG_Release(i); /* one-shot from TRG_StartOnce() is done */
+        }
+        ExitCritical();
+      }
+    }
+  }
 }
 
+uint16_t TRG_GetOverruns(TRG_Handle trigger) {
+  return TRG_Triggers[trigger].overruns;
+}
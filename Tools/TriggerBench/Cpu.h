@@ -0,0 +1,8 @@
+/* Host stand-in for the Processor Expert Cpu.h, for TriggerBench only. */
+#ifndef CPU_H_
+#define CPU_H_
+
+#define EnterCritical()
+#define ExitCritical()
+
+#endif /* CPU_H_ */
@@ -0,0 +1,17 @@
+/* Host stand-in for the Processor Expert PE_Types.h, for TriggerBench only. */
+#ifndef PE_TYPES_H_
+#define PE_TYPES_H_
+
+#include <stdint.h>
+
+typedef unsigned char bool;
+typedef unsigned char byte;
+
+#define TRUE				1
+#define FALSE				0
+
+#define ERR_OK				0x00U
+#define ERR_NOTAVAIL		0x09U
+#define ERR_PARAM_INDEX		0x86U
+
+#endif /* PE_TYPES_H_ */
@@ -0,0 +1,131 @@
+/**
+ * \file
+ * \brief Host benchmark and check of the Trigger module.
+ *
+ * Runs Sources/Trigger.c on the PC with stand-ins for PE_Types.h and
+ * Cpu.h. The pool is raised for the run, all triggers are TRG_ISR so the
+ * TRG_Due bit mask (32 entries) is never used above the target pool size.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -Wall -DTRG_POOL_SIZE=250 -ITools/TriggerBench -IProject_Headers \
+ *       Tools/TriggerBench/TriggerBench.c Sources/Trigger.c -o TriggerBench
+ *   ./TriggerBench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "Trigger.h"
+
+#define BENCH_TICKS		1000000UL	/* ticks per measurement */
+#define BENCH_MAX_PERIOD	1000		/* periods are 1..BENCH_MAX_PERIOD ticks */
+
+static unsigned long tick;			/* ticks since TRG_Init() */
+static unsigned long fired;
+static int errors;
+
+static void BENCH_Count(void* unused) {
+	fired++;
+}
+
+/* Periodic check: must fire exactly at tick (phase + n*period). */
+typedef struct {
+	unsigned long next;					/* 0: don't check the tick */
+	unsigned long period;
+	unsigned long count;
+} BENCH_Phase;
+
+static void BENCH_CheckPhase(void* p) {
+	BENCH_Phase* ph = (BENCH_Phase*) p;
+	ph->count++;
+	if(ph->next == 0) {
+		return;								/* bulk ticks, checked by the caller */
+	}
+	if(tick != ph->next) {
+		printf("  periodic fired at %lu, expected %lu\n", tick, ph->next);
+		errors++;
+	}
+	ph->next = tick + ph->period;
+}
+
+static void BENCH_Tick(void) {
+	tick++;
+	TRG_IncTick();
+}
+
+/*! \brief Triggers set with 0 ticks between two ticks must not delay the others. */
+static void BENCH_CheckZeroTicks(void) {
+	static BENCH_Phase ph = {5, 5, 0};
+	TRG_Handle h, once;
+	int i;
+
+	TRG_Init();
+	tick = 0;
+	h = TRG_Alloc();
+	TRG_SetMode(h, TRG_ISR);
+	TRG_SetPeriodic(h, 5, 5, BENCH_CheckPhase, &ph);
+	for(i=0; i<100; i++) {
+		if(i % 3 == 0) {
+			once = TRG_StartOnce(0, BENCH_Count, NULL);
+			TRG_SetMode(once, TRG_ISR);
+		}
+		BENCH_Tick();
+	}
+	/* same with the ticks passed on in bulk, as TMR_Idle() does */
+	ph.next = 0;
+	for(i=0; i<20; i++) {
+		once = TRG_StartOnce(0, BENCH_Count, NULL);
+		TRG_SetMode(once, TRG_ISR);
+		tick += 7;
+		TRG_AddTicks(7);
+		if(ph.count != tick/5 || TRG_TicksToNext() != 5 - tick%5) {
+			printf("  after %lu ticks: %lu periods, next in %u\n", tick, ph.count, TRG_TicksToNext());
+			errors++;
+		}
+	}
+	printf("zero tick triggers: %s\n", errors ? "FAILED" : "ok");
+}
+
+/*! \brief Average time of TRG_IncTick() with n active periodic triggers. */
+static void BENCH_Run(int n) {
+	struct timespec t0, t1;
+	unsigned long i;
+	double ns;
+	TRG_Handle h;
+	int k;
+
+	TRG_Init();
+	tick = 0;
+	fired = 0;
+	srand(1);
+	for(k=0; k<n; k++) {
+		h = TRG_Alloc();
+		if(h == TRG_NO_HANDLE) {
+			printf("pool exhausted at %d triggers\n", k);
+			return;
+		}
+		TRG_SetMode(h, TRG_ISR);
+		TRG_SetPeriodic(h, (TRG_TriggerTime) (1 + rand() % BENCH_MAX_PERIOD),
+				(TRG_TriggerTime) (1 + rand() % BENCH_MAX_PERIOD), BENCH_Count, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i=0; i<BENCH_TICKS; i++) {
+		BENCH_Tick();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / BENCH_TICKS;
+	printf("%4d triggers: %7.1f ns/tick, %6.3f expiries/tick, %7.1f ns/expiry\n",
+			n, ns, (double) fired / BENCH_TICKS, fired ? ns * BENCH_TICKS / fired : 0.0);
+}
+
+int main(void) {
+	static const int sizes[] = {0, 1, 16, 64, 128, 240};
+	unsigned int i;
+
+	BENCH_CheckZeroTicks();
+	printf("TRG_IncTick(), periods 1..%d ticks, %lu ticks each:\n", BENCH_MAX_PERIOD, BENCH_TICKS);
+	for(i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		BENCH_Run(sizes[i]);
+	}
+	return errors ? 1 : 0;
+}